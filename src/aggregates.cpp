@@ -0,0 +1,255 @@
+#include "gray.hpp"
+#include "util.hpp"
+#include <algorithm>
+
+BVHAggregate::BVHAggregate (const std::vector<std::shared_ptr<const Primitive>>& in)
+{
+    std::vector<BBox> bounds;
+    for (auto& p : in) {
+        BBox b = p->get_bbox();
+        if (b.is_finite()) {
+            prims.push_back(p);
+            bounds.push_back(b);
+        }
+        else {
+            unbounded.push_back(p);
+        }
+    }
+    if (!prims.empty()) {
+        nodes.reserve(2 * prims.size());
+        build(bounds, 0, prims.size());
+    }
+}
+
+int BVHAggregate::build (std::vector<BBox>& bounds, int begin, int end)
+{
+    int index = nodes.size();
+    nodes.push_back(Node());
+
+    BBox bbox;
+    BBox centroids;
+    for (int i = begin; i < end; i++) {
+        bbox.extend(bounds[i]);
+        centroids.extend(bounds[i].center());
+    }
+    nodes[index].bbox = bbox;
+
+    int count = end - begin;
+    int axis = abs_max_elem(centroids.dim());
+    if (count <= 2 || centroids.dim()[axis] == 0) {
+        nodes[index].offset = begin;
+        nodes[index].count = count;
+        nodes[index].axis = 0;
+        return index;
+    }
+
+    // Split at the median centroid along the longest axis, keeping the
+    // primitives and their bounds in the same order.
+    int mid = (begin + end) / 2;
+    std::vector<int> order(count);
+    for (int i = 0; i < count; i++) order[i] = begin + i;
+    std::nth_element(order.begin(), order.begin() + (mid - begin), order.end(),
+                     [&](int a, int b) {
+                         return bounds[a].center()[axis] < bounds[b].center()[axis];
+                     });
+    std::vector<BBox> tmp_bounds(count);
+    std::vector<std::shared_ptr<const Primitive>> tmp_prims(count);
+    for (int i = 0; i < count; i++) {
+        tmp_bounds[i] = bounds[order[i]];
+        tmp_prims[i] = prims[order[i]];
+    }
+    std::copy(tmp_bounds.begin(), tmp_bounds.end(), bounds.begin() + begin);
+    std::copy(tmp_prims.begin(), tmp_prims.end(), prims.begin() + begin);
+
+    build(bounds, begin, mid);
+    int second = build(bounds, mid, end);
+    nodes[index].offset = second;
+    nodes[index].count = 0;
+    nodes[index].axis = axis;
+    return index;
+}
+
+bool BVHAggregate::intersect (Ray& r, Isect* isect, const Isect* prev) const
+{
+    bool hit = false;
+    for (auto& prim : unbounded) {
+        hit |= prim->intersect(r, isect, prev);
+    }
+    if (nodes.empty()) return hit;
+
+    vec3 inv_d(1.0f / r.d.x, 1.0f / r.d.y, 1.0f / r.d.z);
+
+    // Visit the child nearer to the ray origin first, so that r.tmax
+    // shrinks early and prunes the farther subtree.
+    int stack[64];
+    int top = 0;
+    int i = 0;
+    while (true) {
+        const Node& node = nodes[i];
+        if (node.bbox.intersect(r, inv_d)) {
+            if (node.count > 0) {
+                for (int k = 0; k < node.count; k++) {
+                    hit |= prims[node.offset + k]->intersect(r, isect, prev);
+                }
+            }
+            else if (inv_d[node.axis] < 0) {
+                stack[top++] = i + 1;
+                i = node.offset;
+                continue;
+            }
+            else {
+                stack[top++] = node.offset;
+                i = i + 1;
+                continue;
+            }
+        }
+        if (top == 0) break;
+        i = stack[--top];
+    }
+    return hit;
+}
+
+bool BVHAggregate::occluded (const Ray& r, const Isect* prev) const
+{
+    for (auto& prim : unbounded) {
+        if (prim->occluded(r, prev)) return true;
+    }
+    if (nodes.empty()) return false;
+
+    vec3 inv_d(1.0f / r.d.x, 1.0f / r.d.y, 1.0f / r.d.z);
+
+    // Any hit will do, so the order of the children doesn't matter.
+    int stack[64];
+    int top = 0;
+    int i = 0;
+    while (true) {
+        const Node& node = nodes[i];
+        if (node.bbox.intersect(r, inv_d)) {
+            if (node.count > 0) {
+                for (int k = 0; k < node.count; k++) {
+                    if (prims[node.offset + k]->occluded(r, prev)) return true;
+                }
+            }
+            else {
+                stack[top++] = node.offset;
+                i = i + 1;
+                continue;
+            }
+        }
+        if (top == 0) break;
+        i = stack[--top];
+    }
+    return false;
+}
+
+BBox BVHAggregate::get_bbox () const
+{
+    BBox b;
+    if (!nodes.empty()) b = nodes[0].bbox;
+    for (auto& prim : unbounded) {
+        b.extend(prim->get_bbox());
+    }
+    return b;
+}
+
+void BVHAggregate::intersect_packet (RayPacket& packet, int first, Isect* isects, bool* hits) const
+{
+    for (auto& prim : unbounded) {
+        prim->intersect_packet(packet, first, isects, hits);
+    }
+    if (nodes.empty()) return;
+
+    // Each entry carries the first ray that hit the node's box; the rays
+    // before it can be skipped in the whole subtree.
+    struct Entry
+    {
+        int node;
+        int first;
+    };
+    Entry stack[64];
+    int top = 0;
+    stack[top++] = Entry{0, first};
+    while (top > 0) {
+        Entry e = stack[--top];
+        const Node& node = nodes[e.node];
+        int f = packet.first_hit(node.bbox, e.first);
+        if (f == packet.size) continue;
+
+        if (node.count > 0) {
+            for (int k = 0; k < node.count; k++) {
+                prims[node.offset + k]->intersect_packet(packet, f, isects, hits);
+            }
+        }
+        else if (packet.rays[f].d[node.axis] < 0) {
+            stack[top++] = Entry{e.node + 1, f};
+            stack[top++] = Entry{node.offset, f};
+        }
+        else {
+            stack[top++] = Entry{node.offset, f};
+            stack[top++] = Entry{e.node + 1, f};
+        }
+    }
+}
+
+
+void RayPacket::update_bounds ()
+{
+    if (size == 0) return;
+    o_min = o_max = rays[0].o;
+    inv_min = inv_max = inv_d[0];
+    tmin = rays[0].tmin;
+    for (int i = 1; i < size; i++) {
+        for (int k = 0; k < 3; k++) {
+            o_min[k] = std::min(o_min[k], rays[i].o[k]);
+            o_max[k] = std::max(o_max[k], rays[i].o[k]);
+            inv_min[k] = std::min(inv_min[k], inv_d[i][k]);
+            inv_max[k] = std::max(inv_max[k], inv_d[i][k]);
+        }
+        tmin = std::min(tmin, rays[i].tmin);
+    }
+    coherent = true;
+    for (int k = 0; k < 3; k++) {
+        bool same_sign = (inv_min[k] > 0 || inv_max[k] < 0);
+        if (!same_sign || std::isinf(inv_min[k]) || std::isinf(inv_max[k])) {
+            coherent = false;
+        }
+    }
+}
+
+/// Bounds of the product of the intervals [a0,a1] and [b0,b1].
+static inline
+void interval_mul (float a0, float a1, float b0, float b1, float* lo, float* hi)
+{
+    float p0 = a0 * b0;
+    float p1 = a0 * b1;
+    float p2 = a1 * b0;
+    float p3 = a1 * b1;
+    *lo = std::min(std::min(p0, p1), std::min(p2, p3));
+    *hi = std::max(std::max(p0, p1), std::max(p2, p3));
+}
+
+int RayPacket::first_hit (const BBox& b, int first) const
+{
+    // Interval arithmetic over all the rays gives a lower bound for their
+    // entry and an upper bound for their exit distance. If those don't
+    // overlap, none of the rays hits the box.
+    if (coherent && size - first > 1) {
+        float tnear = tmin;
+        float tfar = INFINITY;
+        for (int k = 0; k < 3; k++) {
+            float near = (inv_min[k] > 0) ? b.min[k] : b.max[k];
+            float far = (inv_min[k] > 0) ? b.max[k] : b.min[k];
+            float lo, hi;
+            interval_mul(near - o_max[k], near - o_min[k], inv_min[k], inv_max[k], &lo, &hi);
+            tnear = std::max(tnear, lo);
+            interval_mul(far - o_max[k], far - o_min[k], inv_min[k], inv_max[k], &lo, &hi);
+            tfar = std::min(tfar, hi);
+        }
+        if (tnear > tfar) return size;
+    }
+
+    for (int i = first; i < size; i++) {
+        if (b.intersect(rays[i], inv_d[i])) return i;
+    }
+    return size;
+}
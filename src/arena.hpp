@@ -0,0 +1,83 @@
+#ifndef _ARENA_HPP_
+#define _ARENA_HPP_
+
+#include <cstddef>
+#include <new>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+/// Bump allocator for short-lived objects, such as the BSDFs of a path.
+/// Memory is handed out from large blocks and given back all at once by
+/// reset(), which keeps the blocks for reuse, so that once the arena has
+/// warmed up no heap allocations are made.
+///
+/// Destructors of the objects are never run. Only objects that own no
+/// resources may be created in an arena.
+class MemoryArena
+{
+public:
+    explicit MemoryArena (size_t block_size = 16*1024)
+        : current(0), offset(0), block_size(block_size)
+    { }
+
+    ~MemoryArena ()
+    {
+        for (auto& b : blocks) delete[] b.ptr;
+    }
+
+    MemoryArena (const MemoryArena&) = delete;
+    MemoryArena& operator= (const MemoryArena&) = delete;
+
+    /// @return 16-byte aligned memory for #size bytes
+    void* alloc (size_t size)
+    {
+        size = (size + 15) & ~(size_t)15;
+        if (blocks.empty() || offset + size > blocks[current].size) {
+            next_block(size);
+        }
+        void* p = blocks[current].ptr + offset;
+        offset += size;
+        return p;
+    }
+
+    template <typename T, typename... Args>
+    T* create (Args&&... args)
+    {
+        return new (alloc(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+
+    /// Frees everything allocated from the arena.
+    void reset ()
+    {
+        current = 0;
+        offset = 0;
+    }
+
+private:
+    struct Block
+    {
+        char* ptr;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t current;
+    size_t offset;
+    size_t block_size;
+
+    /// Moves on to the first of the following blocks that fits #size bytes,
+    /// allocating a new one if there is none.
+    void next_block (size_t size)
+    {
+        size_t i = blocks.empty() ? 0 : current + 1;
+        while (i < blocks.size() && blocks[i].size < size) i++;
+        if (i == blocks.size()) {
+            size_t n = std::max(size, block_size);
+            blocks.push_back(Block{new char[n], n});
+        }
+        current = i;
+        offset = 0;
+    }
+};
+
+#endif // _ARENA_HPP_
@@ -0,0 +1,66 @@
+#include "distribution.hpp"
+#include <algorithm>
+
+Distribution1D::Distribution1D (const float* f, int n)
+    : func(f, f+n), cdf(n+1)
+{
+    cdf[0] = 0;
+    for (int i = 0; i < n; i++) {
+        cdf[i+1] = cdf[i] + func[i] / n;
+    }
+    func_int = cdf[n];
+    for (int i = 1; i <= n; i++) {
+        cdf[i] = (func_int > 0) ? cdf[i] / func_int : float(i) / n;
+    }
+}
+
+float Distribution1D::sample (float u, float* pdf, int* offset) const
+{
+    int n = func.size();
+    // The last piece whose cdf is <= u, skipping the empty ones.
+    int i = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin() - 1;
+    i = std::max(0, std::min(n-1, i));
+    *offset = i;
+
+    float du = u - cdf[i];
+    float width = cdf[i+1] - cdf[i];
+    if (width > 0) du /= width;
+    *pdf = (func_int > 0) ? func[i] / func_int : 1;
+    return std::min((i + du) / n, 1 - 1e-7f);
+}
+
+float Distribution1D::pdf (float x) const
+{
+    int n = func.size();
+    int i = std::max(0, std::min(n-1, (int)(x * n)));
+    return (func_int > 0) ? func[i] / func_int : 1;
+}
+
+
+Distribution2D::Distribution2D (const float* f, int nu, int nv)
+{
+    conditional.reserve(nv);
+    std::vector<float> row_int(nv);
+    for (int v = 0; v < nv; v++) {
+        conditional.push_back(Distribution1D(&f[v*nu], nu));
+        row_int[v] = conditional[v].integral();
+    }
+    marginal.reset(new Distribution1D(&row_int[0], nv));
+}
+
+vec2 Distribution2D::sample (const vec2& u, float* pdf) const
+{
+    float pdf_v, pdf_u;
+    int v, iu;
+    float y = marginal->sample(u[1], &pdf_v, &v);
+    float x = conditional[v].sample(u[0], &pdf_u, &iu);
+    *pdf = pdf_v * pdf_u;
+    return vec2(x, y);
+}
+
+float Distribution2D::pdf (const vec2& p) const
+{
+    int nv = conditional.size();
+    int v = std::max(0, std::min(nv-1, (int)(p[1] * nv)));
+    return marginal->pdf(p[1]) * conditional[v].pdf(p[0]);
+}
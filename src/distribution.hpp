@@ -0,0 +1,50 @@
+#ifndef _DISTRIBUTION_HPP_
+#define _DISTRIBUTION_HPP_
+
+#include "mymath.hpp"
+#include <memory>
+#include <vector>
+
+/// Piecewise-constant distribution over [0,1) with n equal pieces,
+/// proportional to a given function. Sampling and pdf evaluation are
+/// O(log n) and O(1).
+class Distribution1D
+{
+public:
+    /// If #f is zero everywhere, the distribution is uniform.
+    Distribution1D (const float* f, int n);
+
+    /// @par offset [out] index of the piece the sample fell in
+    /// @return sample in [0,1)
+    float sample (float u, float* pdf, int* offset) const;
+    float pdf (float x) const;
+
+    int size () const { return func.size(); }
+    /// Integral of the function over [0,1).
+    float integral () const { return func_int; }
+
+private:
+    std::vector<float> func;
+    /// cdf[i] is the integral of the normalized function over [0, i/n).
+    std::vector<float> cdf;
+    float func_int;
+};
+
+/// Piecewise-constant distribution over [0,1)^2, proportional to a
+/// function given as nu x nv values in row-major order. A row is picked
+/// from the marginal distribution and the column from that row's
+/// conditional distribution.
+class Distribution2D
+{
+public:
+    Distribution2D (const float* f, int nu, int nv);
+
+    vec2 sample (const vec2& u, float* pdf) const;
+    float pdf (const vec2& p) const;
+
+private:
+    std::vector<Distribution1D> conditional;
+    std::unique_ptr<Distribution1D> marginal;
+};
+
+#endif // _DISTRIBUTION_HPP_
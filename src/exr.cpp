@@ -0,0 +1,304 @@
+#include "exr.hpp"
+#include "lodepng.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+/// Rounds to the nearest half, ties to even. Too large values become
+/// infinity, and too small ones denormals or zero.
+static uint16_t float_to_half (float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7fffffff;
+
+    if (abs >= 0x7f800000) {
+        // Infinity stays infinity, NaN stays NaN.
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+    }
+    if (abs >= 0x477ff000) {
+        // 65520 and up round past the largest half, 65504.
+        return sign | 0x7c00;
+    }
+    if (abs < 0x38800000) {
+        // Below the smallest normal half, 2^-14.
+        if (abs < 0x33000000) return sign;
+        uint32_t e = abs >> 23;
+        uint32_t m = (abs & 0x7fffff) | 0x800000;
+        int shift = 126 - e;
+        uint32_t h = m >> shift;
+        uint32_t rest = m & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1))) h++;
+        return sign | h;
+    }
+    // Rebias the exponent from 127 to 15 and drop 13 mantissa bits.
+    uint32_t h = (abs - 0x38000000) >> 13;
+    uint32_t rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) h++;
+    return sign | h;
+}
+
+/// Splits the bytes into the even and the odd ones and replaces them by
+/// their differences, as EXR does before RLE and ZIP compression. Makes
+/// the high bytes of smooth half data compress well.
+static void exr_predict (const std::vector<uint8_t>& in, std::vector<uint8_t>& out)
+{
+    size_t n = in.size();
+    out.resize(n);
+    size_t half = (n + 1) / 2;
+    for (size_t i = 0; i < n; i++) {
+        out[(i % 2 == 0) ? i/2 : half + i/2] = in[i];
+    }
+    int prev = n > 0 ? out[0] : 0;
+    for (size_t i = 1; i < n; i++) {
+        int d = (int)out[i] - prev + (128 + 256);
+        prev = out[i];
+        out[i] = d & 0xff;
+    }
+}
+
+/// Run-length encoding of EXR: a run of 3 to 128 equal bytes is stored
+/// as its length minus one and the byte, other bytes in groups of up to
+/// 127 as minus their count followed by the bytes themselves.
+static void exr_rle (const std::vector<uint8_t>& in, std::vector<uint8_t>& out)
+{
+    const int min_run = 3;
+    const int max_run = 127;
+    out.clear();
+    size_t n = in.size();
+    size_t start = 0;
+    while (start < n) {
+        size_t end = start + 1;
+        while (end < n && in[end] == in[start] && end - start - 1 < (size_t)max_run) end++;
+        if (end - start >= (size_t)min_run) {
+            out.push_back((uint8_t)(end - start - 1));
+            out.push_back(in[start]);
+            start = end;
+            continue;
+        }
+        // Literal bytes up to where the next run of three starts.
+        end = start;
+        while (end < n && end - start < (size_t)max_run &&
+               !(end + 2 < n && in[end] == in[end+1] && in[end] == in[end+2])) {
+            end++;
+        }
+        if (end == start) end++;
+        out.push_back((uint8_t)(-(int)(end - start)));
+        out.insert(out.end(), in.begin() + start, in.begin() + end);
+        start = end;
+    }
+}
+
+namespace {
+
+/// Little-endian byte buffer for the header and the tile chunks.
+struct Bytes
+{
+    std::vector<uint8_t> v;
+
+    void u8 (uint8_t x) { v.push_back(x); }
+    void i32 (int32_t x)
+    {
+        for (int i = 0; i < 4; i++) v.push_back((uint32_t)x >> (8*i));
+    }
+    void u64 (uint64_t x)
+    {
+        for (int i = 0; i < 8; i++) v.push_back(x >> (8*i));
+    }
+    void f32 (float f)
+    {
+        uint32_t x;
+        memcpy(&x, &f, 4);
+        i32(x);
+    }
+    void str (const std::string& s)
+    {
+        v.insert(v.end(), s.begin(), s.end());
+        v.push_back(0);
+    }
+    void attr (const char* name, const char* type, const Bytes& value)
+    {
+        str(name);
+        str(type);
+        i32(value.v.size());
+        v.insert(v.end(), value.v.begin(), value.v.end());
+    }
+};
+
+} // namespace
+
+ExrCompression exr_compression (const std::string& name)
+{
+    if (name == "none") return ExrCompression::NONE;
+    if (name == "rle") return ExrCompression::RLE;
+    if (name == "zip") return ExrCompression::ZIP;
+    throw std::range_error("Bad EXR compression " + name);
+}
+
+void write_exr (const char* filename, int width, int height,
+                const std::vector<std::string>& channels, const ExrRowReader& read,
+                ExrCompression compression, int threads, int tile_size)
+{
+    int nch = channels.size();
+    // Channels are stored sorted by name.
+    std::vector<int> order(nch);
+    for (int c = 0; c < nch; c++) order[c] = c;
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return channels[a] < channels[b];
+    });
+
+    Bytes header;
+    header.i32(20000630);
+    // Version 2, single-part tiled.
+    header.i32(2 | 0x200);
+    Bytes chlist;
+    for (int c : order) {
+        chlist.str(channels[c]);
+        chlist.i32(1);          // HALF
+        chlist.i32(0);          // pLinear and reserved
+        chlist.i32(1);          // x sampling
+        chlist.i32(1);          // y sampling
+    }
+    chlist.u8(0);
+    header.attr("channels", "chlist", chlist);
+    Bytes comp;
+    comp.u8((uint8_t)compression);
+    header.attr("compression", "compression", comp);
+    Bytes window;
+    window.i32(0);
+    window.i32(0);
+    window.i32(width - 1);
+    window.i32(height - 1);
+    header.attr("dataWindow", "box2i", window);
+    header.attr("displayWindow", "box2i", window);
+    Bytes line_order;
+    line_order.u8(0);           // INCREASING_Y
+    header.attr("lineOrder", "lineOrder", line_order);
+    Bytes aspect;
+    aspect.f32(1);
+    header.attr("pixelAspectRatio", "float", aspect);
+    Bytes center;
+    center.f32(0);
+    center.f32(0);
+    header.attr("screenWindowCenter", "v2f", center);
+    Bytes window_width;
+    window_width.f32(1);
+    header.attr("screenWindowWidth", "float", window_width);
+    Bytes tiles;
+    tiles.i32(tile_size);
+    tiles.i32(tile_size);
+    tiles.u8(0);                // ONE_LEVEL, ROUND_DOWN
+    header.attr("tiles", "tiledesc", tiles);
+    header.u8(0);
+
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+    int ntiles = tiles_x * tiles_y;
+    std::vector<Bytes> chunks(ntiles);
+
+    // A small window and no lazy matching: most of what ZIP gains on
+    // rendered images comes from the predictor, and deflating a big frame
+    // with the default settings takes longer than the render.
+    LodePNGCompressSettings zip_settings = lodepng_default_compress_settings;
+    zip_settings.windowsize = 256;
+    zip_settings.nicematch = 32;
+    zip_settings.lazymatching = 0;
+
+    std::atomic<int> next_tile(0);
+    std::atomic<bool> failed(false);
+    auto work = [&]() {
+        std::vector<float> values(tile_size * nch);
+        std::vector<uint8_t> raw;
+        std::vector<uint8_t> predicted;
+        std::vector<uint8_t> packed;
+        int t;
+        while ((t = next_tile++) < ntiles) {
+            int tx = t % tiles_x;
+            int ty = t / tiles_x;
+            int x0 = tx * tile_size;
+            int y0 = ty * tile_size;
+            int w = std::min(tile_size, width - x0);
+            int h = std::min(tile_size, height - y0);
+
+            // Each line of the tile holds the line of every channel in turn.
+            raw.resize((size_t)w * h * nch * 2);
+            uint8_t* dst = &raw[0];
+            for (int y = y0; y < y0 + h; y++) {
+                read(y, x0, w, &values[0]);
+                for (int c : order) {
+                    for (int x = 0; x < w; x++) {
+                        uint16_t v = float_to_half(values[x*nch + c]);
+                        *dst++ = v & 0xff;
+                        *dst++ = v >> 8;
+                    }
+                }
+            }
+
+            const uint8_t* data = &raw[0];
+            size_t size = raw.size();
+            unsigned char* zipped = nullptr;
+            if (compression != ExrCompression::NONE) {
+                exr_predict(raw, predicted);
+                if (compression == ExrCompression::RLE) {
+                    exr_rle(predicted, packed);
+                }
+                else {
+                    size_t zsize = 0;
+                    if (lodepng_zlib_compress(&zipped, &zsize, &predicted[0], predicted.size(),
+                                              &zip_settings)) {
+                        failed = true;
+                        free(zipped);
+                        return;
+                    }
+                    packed.assign(zipped, zipped + zsize);
+                    free(zipped);
+                }
+                // Tiles that don't shrink are stored as they are.
+                if (packed.size() < raw.size()) {
+                    data = &packed[0];
+                    size = packed.size();
+                }
+            }
+
+            Bytes& chunk = chunks[t];
+            chunk.v.reserve(20 + size);
+            chunk.i32(tx);
+            chunk.i32(ty);
+            chunk.i32(0);
+            chunk.i32(0);
+            chunk.i32(size);
+            chunk.v.insert(chunk.v.end(), data, data + size);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; i++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& th : pool) th.join();
+    if (failed) throw std::runtime_error(std::string("cannot compress ") + filename);
+
+    // The offset table points at the chunks, which follow it in order.
+    Bytes offsets;
+    uint64_t offset = header.v.size() + 8 * (uint64_t)ntiles;
+    for (auto& chunk : chunks) {
+        offsets.u64(offset);
+        offset += chunk.v.size();
+    }
+
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) throw std::runtime_error(std::string("cannot write ") + filename);
+    bool ok = fwrite(&header.v[0], 1, header.v.size(), fp) == header.v.size() &&
+              fwrite(&offsets.v[0], 1, offsets.v.size(), fp) == offsets.v.size();
+    for (size_t i = 0; ok && i < chunks.size(); i++) {
+        ok = fwrite(&chunks[i].v[0], 1, chunks[i].v.size(), fp) == chunks[i].v.size();
+    }
+    if (fclose(fp) != 0 || !ok) throw std::runtime_error(std::string("cannot write ") + filename);
+}
@@ -0,0 +1,34 @@
+#ifndef _EXR_HPP_
+#define _EXR_HPP_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/// Compression of the tiles of an EXR file. The values are those of the
+/// file format.
+enum class ExrCompression
+{
+    NONE = 0,
+    RLE = 1,
+    ZIP = 3
+};
+
+/// Fills #out with the channel values of #n pixels of row #y, starting
+/// at column #x0, pixel by pixel. Rows are counted from the top. Called
+/// from several threads at once.
+typedef std::function<void(int y, int x0, int n, float* out)> ExrRowReader;
+
+/// Writes a tiled OpenEXR file with half-float channels. The tiles are
+/// converted and compressed on #threads threads, and the file is then
+/// written front to back in a few large writes.
+/// @par channels   Names of the channels, in the order #read gives them.
+/// Throws std::runtime_error if the file can't be written.
+void write_exr (const char* filename, int width, int height,
+                const std::vector<std::string>& channels, const ExrRowReader& read,
+                ExrCompression compression, int threads, int tile_size = 64);
+
+/// Parses the name of a compression: "none", "rle" or "zip".
+ExrCompression exr_compression (const std::string& name);
+
+#endif // _EXR_HPP_
@@ -5,18 +5,18 @@ extern "C" {
 }
 // #include <cmath>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <memory>
 using std::auto_ptr;
 
-Film::Film (int xres, int yres)
-    : xres(xres), yres(yres), data(xres*yres)
+Film::Film (int xres, int yres, Filter filter)
+    : xres(xres), yres(yres), filter(filter), data(xres*yres)
 { }
 
 void Film::add_sample (float x, float y, const Spectrum& s)
 {
-    int xi = clamp((int)(x*xres), 0, xres-1);
-    int yi = clamp((int)(y*yres), 0, yres-1);
-    data[xi + yi*xres].add(s, 1.0);
+    FilmTile(*this, 0, 0, xres, yres, false).add_sample(x, y, s);
 }
 
 void Film::merge (const Film& film, int xofs, int yofs)
@@ -25,46 +25,195 @@ void Film::merge (const Film& film, int xofs, int yofs)
         for (int x = 0; x < film.xres; x++) {
             Pixel& dst = data[xofs + x + (yofs+ y)*xres];
             const Pixel& src = film.data[x+y*film.xres];
-            dst.add(src.L, src.weight);
+            dst.add(src.L, src.weight, src.Y2, src.count);
         }
     }
 }
 
+float Film::relative_error () const
+{
+    return relative_error(0, 0, xres, yres);
+}
 
-void Film::save (const char* filename)
+float Film::relative_error (int x0, int y0, int w, int h) const
 {
-    save_png(filename);
+    // Relative to the whole image rather than pixel by pixel, so that dark
+    // pixels with the odd bright sample don't dominate. The per-pixel
+    // variances are unbiased, and so is their sum. Pixels that no sample
+    // reached, such as those outside the tiles of a shard or of -S, are
+    // not being rendered and are left out.
+    double var = 0;
+    double Y = 0;
+    int n = 0;
+    for (int y = y0; y < y0 + h; y++) {
+        for (int x = x0; x < x0 + w; x++) {
+            const Pixel& d = data[x + y*xres];
+            if (d.count == 0) continue;
+            var += d.variance();
+            Y += d.luminosity();
+            n++;
+        }
+    }
+    if (n == 0) return INFINITY;
+    return sqrt(var / n) / std::max(Y / n, 1e-6);
 }
 
-void Film::save_png (const char* filename)
+
+FilmTile::FilmTile (Film& film, int xofs, int yofs, int xres, int yres, bool shared)
+    : film(&film),
+    xofs(xofs), yofs(yofs),
+    xres(xres), yres(yres),
+    margin((shared && film.filter == Film::TENT) ? 1 : 0)
+{ }
+
+void FilmTile::add_sample (float x, float y, const Spectrum& s)
 {
-    tone_mapping();
-    std::vector<uint8_t> rgb(xres*yres*3);
+    float Y = Pixel::luminance(s);
+    if (film->filter == Film::BOX) {
+        int xi = clamp((int)(x*xres), 0, xres-1);
+        int yi = clamp((int)(y*yres), 0, yres-1);
+        add(xofs + xi, yofs + yi, s, 1.0f, Y*Y);
+        return;
+    }
 
-    for (int y = 0; y < yres; y++) {
-        for (int x = 0; x < xres; x++) {
-            int i = x + y*xres;
-            int o = x + (yres-1-y)*xres;
-            Spectrum L = data[i].tonemapped;
-            L = clamp(L*255.0f, Spectrum(0), Spectrum(255));
+    // Tent filter of radius one pixel: the sample reaches the two nearest
+    // pixel centers on both axes.
+    float px = xofs + x*xres - 0.5f;
+    float py = yofs + y*yres - 0.5f;
+    int x0 = (int)floorf(px);
+    int y0 = (int)floorf(py);
+    float fx = px - x0;
+    float fy = py - y0;
+    float wx[2] = { 1 - fx, fx };
+    float wy[2] = { 1 - fy, fy };
+    for (int j = 0; j < 2; j++) {
+        int yi = y0 + j;
+        if (yi < 0 || yi >= film->yres) continue;
+        for (int i = 0; i < 2; i++) {
+            int xi = x0 + i;
+            if (xi < 0 || xi >= film->xres) continue;
+            float w = wx[i] * wy[j];
+            if (w > 0) add(xi, yi, s * w, w, w * Y*Y);
+        }
+    }
+}
+
+/// Atomic *p += v.
+static inline
+void atomic_add (float* p, float v)
+{
+    uint32_t* bits = reinterpret_cast<uint32_t*>(p);
+    uint32_t old_bits = __atomic_load_n(bits, __ATOMIC_RELAXED);
+    while (true) {
+        float old;
+        memcpy(&old, &old_bits, 4);
+        float sum = old + v;
+        uint32_t new_bits;
+        memcpy(&new_bits, &sum, 4);
+        if (__atomic_compare_exchange_n(bits, &old_bits, new_bits, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+/// Atomic read of a float that is added to with atomic_add.
+static inline
+float atomic_load (const float* p)
+{
+    uint32_t bits = __atomic_load_n(reinterpret_cast<const uint32_t*>(p), __ATOMIC_RELAXED);
+    float v;
+    memcpy(&v, &bits, 4);
+    return v;
+}
+
+void FilmTile::add (int x, int y, const Spectrum& s, float w, float Y2)
+{
+    Pixel& p = film->data[x + y*film->xres];
+    bool edge = (x < xofs + margin || x >= xofs + xres - margin ||
+                 y < yofs + margin || y >= yofs + yres - margin);
+    if (!edge) {
+        p.add(s, w, Y2, 1);
+        return;
+    }
+    for (int k = 0; k < 3; k++) {
+        atomic_add(&p.L[k], s[k]);
+    }
+    atomic_add(&p.weight, w);
+    atomic_add(&p.Y2, Y2);
+    atomic_add(&p.count, 1);
+}
+
+void Film::copy_tile (const Film& film, int x0, int y0, int w, int h)
+{
+    // The same margin as the FilmTiles of a shared film: the pixels
+    // within it are added to atomically, the rest only by the thread that
+    // rendered the tile.
+    int margin = (film.filter == TENT) ? 1 : 0;
+    for (int y = std::max(y0 - margin, 0); y < std::min(y0 + h + margin, yres); y++) {
+        for (int x = std::max(x0 - margin, 0); x < std::min(x0 + w + margin, xres); x++) {
+            const Pixel& src = film.data[x + y*xres];
+            Pixel& dst = data[x + y*xres];
+            bool edge = (x < x0 + margin || x >= x0 + w - margin ||
+                         y < y0 + margin || y >= y0 + h - margin);
+            if (!edge) {
+                dst = src;
+                continue;
+            }
             for (int k = 0; k < 3; k++) {
-                rgb[o*3+k] = L[k];
+                dst.L[k] = atomic_load(&src.L[k]);
             }
+            dst.weight = atomic_load(&src.weight);
+            dst.Y2 = atomic_load(&src.Y2);
+            dst.count = atomic_load(&src.count);
         }
     }
+}
+
 
-    lodepng_encode24_file(filename, &rgb[0], xres, yres);
+void Film::save (const char* filename, const ToneMap& tm, int threads) const
+{
+    save_png(filename, tm, threads);
+}
+
+void Film::save_png (const char* filename, const ToneMap& tm, int threads) const
+{
+    std::vector<uint8_t> rgb;
+    tone_map(*this, tm, threads, &rgb);
+
+    // Plain RGB without the search for a smaller color type, and a quick
+    // deflate: with the defaults, encoding a big frame takes seconds.
+    lodepng::State state;
+    state.info_raw.colortype = LCT_RGB;
+    state.info_raw.bitdepth = 8;
+    state.info_png.color.colortype = LCT_RGB;
+    state.info_png.color.bitdepth = 8;
+    state.encoder.auto_convert = LAC_NO;
+    state.encoder.zlibsettings.windowsize = 256;
+    state.encoder.zlibsettings.nicematch = 32;
+    state.encoder.zlibsettings.lazymatching = 0;
+    std::vector<unsigned char> png;
+    if (lodepng::encode(png, &rgb[0], xres, yres, state) != 0) {
+        throw std::runtime_error(std::string("cannot encode ") + filename);
+    }
+    lodepng::save_file(png, filename);
 }
 
 void Film::save_rgbe (const char* filename)
 {
     FILE* fp = fopen(filename, "wb");
+    // The RLE writer makes many small writes.
+    setvbuf(fp, nullptr, _IOFBF, 1 << 20);
     RGBE_WriteHeader(fp, xres, yres, NULL);
+    std::vector<float> row(xres * 3);
     for (int y = 0; y < yres; y++) {
         for (int x = 0; x < xres; x++) {
             Spectrum v = data[x+y*xres].normalized();
-            RGBE_WritePixels(fp, &v.x, 1);
+            row[x*3+0] = v[0];
+            row[x*3+1] = v[1];
+            row[x*3+2] = v[2];
         }
+        RGBE_WritePixels_RLE(fp, &row[0], xres, 1);
     }
     fclose(fp);
 }
@@ -74,15 +223,33 @@ void Film::save_float (const char* filename)
     FILE* fp = fopen(filename, "wb");
     fwrite(&xres, 4, 1, fp);
     fwrite(&yres, 4, 1, fp);
+    std::vector<Spectrum> row(xres);
     for (int y = 0; y < yres; y++) {
         for (int x = 0; x < xres; x++) {
-            Spectrum v = data[x+y*xres].normalized();
-            fwrite(&v, sizeof(Spectrum), 1, fp);
+            row[x] = data[x+y*xres].normalized();
         }
+        fwrite(&row[0], sizeof(Spectrum), xres, fp);
     }
     fclose(fp);
 }
 
+void Film::save_exr (const char* filename, ExrCompression compression, int threads)
+{
+    static const std::vector<std::string> channels = { "R", "G", "B", "variance" };
+    // The film's first row is the bottom one, as in save_png.
+    auto read = [&](int y, int x0, int n, float* out) {
+        const Pixel* p = &data[x0 + (yres-1-y)*xres];
+        for (int i = 0; i < n; i++) {
+            Spectrum v = p[i].normalized();
+            out[i*4+0] = v[0];
+            out[i*4+1] = v[1];
+            out[i*4+2] = v[2];
+            out[i*4+3] = p[i].variance();
+        }
+    };
+    write_exr(filename, xres, yres, channels, read, compression, threads);
+}
+
 void Film::load_float (const char* filename)
 {
     FILE* fp = fopen(filename, "rb");
@@ -100,49 +267,80 @@ void Film::load_float (const char* filename)
     fclose(fp);
 }
 
-void Film::tone_mapping ()
-{
-    // Erik Reinhard
-    // Photographic Tone Reproduction for Digital Images
-    // (Reinhard '02)
+/// Accumulation file: the magic, a header of int32s
+///     version xres yres filter pass spp seed frame
+/// and then for each pixel, row by row, the float32s
+///     L.r L.g L.b weight Y2 count
+static const char acc_magic[8] = { 'G','R','A','Y','A','C','C','\n' };
+static const int32_t acc_version = 1;
+static const int acc_pixel_floats = 6;
 
-    int N = xres*yres;
-
-    for (int ch = 0; ch < 3; ch++) {
+void Film::save_accumulation (const char* filename, const RenderProgress& progress) const
+{
+    std::string tmp = std::string(filename) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp) throw std::runtime_error("cannot write " + tmp);
 
-        double sum(0.0);
-        double Lmin = 999999;
-        double Lmax = 0;
-        for (auto& d : data) {
-            double Lw = d.normalized()[ch]*10;
-            sum += log(0.00001 + Lw);
-            if (Lw < Lmin) Lmin = Lw;
-            if (Lw > Lmax) Lmax = Lw;
+    int32_t header[8] = { acc_version, xres, yres, filter,
+                          progress.pass, progress.spp, (int32_t)progress.seed, progress.frame };
+    bool ok = fwrite(acc_magic, sizeof(acc_magic), 1, fp) == 1 &&
+              fwrite(header, sizeof(header), 1, fp) == 1;
+    std::vector<float> row(xres * acc_pixel_floats);
+    for (int y = 0; ok && y < yres; y++) {
+        for (int x = 0; x < xres; x++) {
+            const Pixel& p = data[x + y*xres];
+            float* dst = &row[x * acc_pixel_floats];
+            dst[0] = p.L[0];
+            dst[1] = p.L[1];
+            dst[2] = p.L[2];
+            dst[3] = p.weight;
+            dst[4] = p.Y2;
+            dst[5] = p.count;
         }
-        // Log average luminance, Lw
-        double Lw = exp(sum /double(N));
-
-        printf("Range of values: %f -- %f\n", Lmin, Lmax);
-        printf("Dynamix range:   %d:1\n", (int)(Lmax/Lmin));
-
-        // the image key value 
-        const double alpha(0.18);
-        const double Lwhite = Lmax;
-        /// the following are from Erik Reinhard:
-        /// Parameter Estimation for Photographic Tone Reproduction
-        // const double alpha = 0.18 * pow(4, (2*log2(Lw)-log2(Lmin)-log2(Lmax)) / (log2(Lmax)-log2(Lmin)));
-        // const double Lwhite = 1.2 * pow(2, log2(Lmax) - log2(Lmin) - 5);
-        const double Lwhite2 = Lwhite*Lwhite;
-        const double gamma = 2.2;
-        for (auto& d : data) {
-            double L = alpha / Lw * d.normalized()[ch];
+        ok = fwrite(&row[0], sizeof(float), row.size(), fp) == row.size();
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), filename) != 0) {
+        remove(tmp.c_str());
+        throw std::runtime_error(std::string("cannot write ") + filename);
+    }
+}
 
-            double Ld = L * (1 + L / Lwhite2) / (1 + L);
+void Film::load_accumulation (const char* filename, RenderProgress* progress)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) throw std::runtime_error(std::string("cannot open ") + filename);
+    std::unique_ptr<FILE, int(*)(FILE*)> closer(fp, fclose);
 
-            d.tonemapped[ch] = pow(Ld, 1/gamma);
+    char magic[8];
+    int32_t header[8];
+    if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+        memcmp(magic, acc_magic, sizeof(magic)) != 0) {
+        throw std::runtime_error(std::string("not an accumulation file: ") + filename);
+    }
+    if (fread(header, sizeof(header), 1, fp) != 1 || header[0] != acc_version) {
+        throw std::runtime_error(std::string("unsupported accumulation file: ") + filename);
+    }
+    if (header[1] <= 0 || header[2] <= 0 || (header[3] != BOX && header[3] != TENT)) {
+        throw std::runtime_error(std::string("bad accumulation file: ") + filename);
+    }
+    xres = header[1];
+    yres = header[2];
+    filter = (Filter)header[3];
+    progress->pass = header[4];
+    progress->spp = header[5];
+    progress->seed = header[6];
+    progress->frame = header[7];
 
+    data.assign(xres*yres, Pixel());
+    std::vector<float> row(xres * acc_pixel_floats);
+    for (int y = 0; y < yres; y++) {
+        if (fread(&row[0], sizeof(float), row.size(), fp) != row.size()) {
+            throw std::runtime_error(std::string("truncated accumulation file: ") + filename);
+        }
+        for (int x = 0; x < xres; x++) {
+            const float* src = &row[x * acc_pixel_floats];
+            data[x + y*xres].add(Spectrum(src[0], src[1], src[2]), src[3], src[4], src[5]);
         }
     }
-
 }
-
@@ -2,58 +2,157 @@
 #define FILM_HPP
 
 #include "gray.hpp"
+#include "exr.hpp"
+#include "tonemap.hpp"
 #include <vector>
 
 struct Pixel
 {
     Spectrum L;
     float weight;
-    Spectrum tonemapped;
+    /// Weighted sum of the squared luminances of the samples.
+    float Y2;
+    /// Number of samples that reached the pixel.
+    float count;
 
-    Pixel () : L(0.f), weight(0.0f), tonemapped(0.f) { }
+    Pixel () : L(0.f), weight(0.0f), Y2(0.0f), count(0.0f) { }
 
-    void add (const Spectrum& Ln, float wn)
+    void add (const Spectrum& Ln, float wn, float Y2n, float cn)
     {
         L += Ln;
         weight += wn;
+        Y2 += Y2n;
+        count += cn;
     }
 
+    /// Black for pixels without samples, such as those outside of the
+    /// tiles of a shard.
     Spectrum normalized () const
     {
-        return L / weight;
+        return (weight > 0) ? L / weight : Spectrum(0.f);
     }
 
     float luminosity () const
     {
+        return (weight > 0) ? luminance(L) / weight : 0.f;
+    }
+
+    /// Variance of the pixel's luminance estimate (the mean of the
+    /// samples), estimated from the spread of the samples. The spread is
+    /// weighted, but the number of samples is their count: with the tent
+    /// filter the weights are fractions of a sample.
+    float variance () const
+    {
+        if (count <= 1) return INFINITY;
+        float mean = luminosity();
+        return std::max((Y2 / weight - mean*mean) / (count - 1), 0.0f);
+    }
 
-        return (L[0] * 0.27 + L[1] * 0.67 + L[2] * 0.06) / weight;
+    static float luminance (const Spectrum& L)
+    {
+        return L[0] * 0.27 + L[1] * 0.67 + L[2] * 0.06;
     }
 };
 
+/// Where a render stands, stored with the film in an accumulation file
+/// so that the render can be resumed.
+struct RenderProgress
+{
+    /// Index of the next pass.
+    int pass;
+    /// Samples per pixel rendered so far.
+    int spp;
+    unsigned int seed;
+    int frame;
+};
+
 class Film
 {
 public:
-    Film (int xres, int yres);
+    /// Reconstruction filters. A box filter adds each sample to the pixel
+    /// it falls in, a tent filter spreads it over the pixels within one
+    /// pixel's distance.
+    enum Filter
+    {
+        BOX,
+        TENT
+    };
+
+    Film (int xres, int yres, Filter filter = BOX);
 
     /// #x and #y are in range 0..1
     void add_sample (float x, float y, const Spectrum& s);
 
     void merge (const Film& film, int xofs, int yofs);
+    /// Copies the pixels of a tile of #film, of the same size as this one,
+    /// that has just been rendered. #film may be rendered into by other
+    /// threads meanwhile; with the tent filter the pixels they share with
+    /// the tile, around and along its edges, are copied atomically.
+    void copy_tile (const Film& film, int x0, int y0, int w, int h);
+
+    /// RMS standard error of the pixels relative to the average luminance,
+    /// over the pixels that have samples. Infinite if there are none.
+    float relative_error () const;
+    /// Same for the pixels of the rectangle at (x0,y0) of size w x h.
+    float relative_error (int x0, int y0, int w, int h) const;
 
-    void save (const char* filename);
+    /// Tone mapped PNG.
+    void save (const char* filename, const ToneMap& tm = ToneMap(), int threads = 1) const;
 
     void save_float (const char* filename);
     void save_rgbe (const char* filename);
     void load_float (const char* filename);
+    /// Tiled half-float OpenEXR with the channels R, G, B and variance,
+    /// the variance of the luminance estimate. The tiles are compressed
+    /// on #threads threads.
+    void save_exr (const char* filename, ExrCompression compression, int threads);
+
+    /// Accumulation files keep the sums of the pixels rather than their
+    /// averages, so that renders can be resumed and partial renders of
+    /// the same image added together with merge(). The file is written
+    /// to a temporary first, so that a crash leaves the previous one.
+    /// Throws std::runtime_error if the file can't be written or read.
+    void save_accumulation (const char* filename, const RenderProgress& progress) const;
+    /// Replaces the film, including its size and filter, with the file.
+    void load_accumulation (const char* filename, RenderProgress* progress);
+    /// Pixels row by row, bottom row first.
+    const Pixel* pixels () const { return &data[0]; }
+
 public:
     int xres, yres;
+    Filter filter;
 
 private:
+    friend class FilmTile;
     std::vector<Pixel> data;
 
-    void save_png (const char* filename);
+    void save_png (const char* filename, const ToneMap& tm, int threads) const;
+};
+
+/// A rectangle of a Film that a single thread renders into.
+/// With a shared film the tiles of the other threads are written at the
+/// same time. They don't overlap, so the pixels are added to without
+/// locking, except near the edges of the tile when the filter reaches
+/// over to the neighbouring tiles; those pixels are added to atomically.
+class FilmTile
+{
+public:
+    FilmTile () : film(nullptr) {}
+    /// @par shared Set if other threads write to #film at the same time.
+    FilmTile (Film& film, int xofs, int yofs, int xres, int yres, bool shared);
+
+    /// #x and #y are in range 0..1 over the tile.
+    void add_sample (float x, float y, const Spectrum& s);
+
+private:
+    Film* film;
+    int xofs, yofs;
+    int xres, yres;
+    /// Pixels closer than this to the tile edges are shared with the
+    /// neighbouring tiles.
+    int margin;
 
-    void tone_mapping ();
+    void add (int x, int y, const Spectrum& s, float w, float Y2);
 };
 
 #endif /* FILM_HPP */
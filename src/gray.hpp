@@ -7,8 +7,12 @@ using std::shared_ptr;
 using std::make_shared;
 #include "mymath.hpp"
 #include <vector>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
 #include "Transform.hpp"
 #include "random.hpp"
+#include "arena.hpp"
 
 typedef vec3 Spectrum;
 
@@ -82,6 +86,10 @@ struct Ray
     vec3 d;
     float tmin, tmax;
 
+    Ray ()
+        : tmin(0), tmax(INFINITY)
+    { }
+
     Ray (const vec3& o, const vec3& d,
          float tmin = 0, float tmax = INFINITY)
         : o(o), d(d), tmin(tmin), tmax(tmax)
@@ -101,10 +109,81 @@ public:
     BBox ();
     BBox (const vec3& min, const vec3& max);
     void extend (const vec3& v);
+    void extend (const BBox& b);
     bool intersect (const Ray& ray) const;
 
+    /// Slab test using the precomputed reciprocal of the ray direction.
+    bool intersect (const Ray& ray, const vec3& inv_d) const
+    {
+        float t0 = ray.tmin;
+        float t1 = ray.tmax;
+        for (int k = 0; k < 3; k++) {
+            float tnear = (min[k] - ray.o[k]) * inv_d[k];
+            float tfar = (max[k] - ray.o[k]) * inv_d[k];
+            if (tnear > tfar) std::swap(tnear, tfar);
+            t0 = tnear > t0 ? tnear : t0;
+            t1 = tfar < t1 ? tfar : t1;
+            if (t0 > t1) return false;
+        }
+        return true;
+    }
+
+    /// Bounding box of the eight corners transformed by #xform.
+    /// An unbounded box stays unbounded.
+    BBox transform (const Transform& xform) const;
+
+    /// False if any of the bounds is infinite (e.g. a plane).
+    bool is_finite () const;
+
+    /// True for a default-constructed box that nothing was added to.
+    bool is_empty () const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+
     /// Bounding box dimensions.
     vec3 dim () const { return max - min; }
+    vec3 center () const { return (min + max) * 0.5f; }
+    float surface_area () const
+    {
+        vec3 d = dim();
+        return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+};
+
+/// Coherent rays traced together through the acceleration structures,
+/// e.g. the camera rays of a small block of pixels. The interval bounds of
+/// the origins and reciprocal directions let the whole packet skip a box
+/// with one test.
+struct RayPacket
+{
+    enum { max_size = 64 };
+
+    Ray rays[max_size];
+    vec3 inv_d[max_size];
+    int size;
+
+    vec3 o_min, o_max;
+    vec3 inv_min, inv_max;
+    float tmin;
+    /// The interval test is valid only if the direction components of all
+    /// rays have the same signs.
+    bool coherent;
+
+    RayPacket () : size(0), coherent(false) {}
+
+    void clear () { size = 0; }
+
+    void add (const Ray& r)
+    {
+        rays[size] = r;
+        inv_d[size] = vec3(1.0f / r.d.x, 1.0f / r.d.y, 1.0f / r.d.z);
+        size++;
+    }
+
+    /// Must be called after all rays have been added.
+    void update_bounds ();
+
+    /// @return index of the first ray from #first on that hits #b,
+    ///         or size if none of them does.
+    int first_hit (const BBox& b, int first) const;
 };
 
 class Material;
@@ -114,6 +193,8 @@ struct Isect
 {
     vec3 p;
     vec3 n;
+    /// Geometric normal. Differs from n only where n is interpolated.
+    vec3 ng;
     Material* mat;
     Spectrum Le; // this is oversimplified
     const Primitive* prim;
@@ -133,7 +214,42 @@ public:
     ///                     the surface normal.
     virtual bool intersect (Ray& r, Isect* isect, bool self, bool inside_self) = 0;
 
+    /// Intersects the rays from #first on, which must be camera rays.
+    /// Sets hits[i] for the rays that hit and shortens their tmax.
+    /// The default traces each ray on its own.
+    virtual void intersect_packet (RayPacket& packet, int first, Isect* isects, bool* hits)
+    {
+        for (int i = first; i < packet.size; i++) {
+            hits[i] |= intersect(packet.rays[i], &isects[i], false, false);
+        }
+    }
+
+    /// Box in shape space that contains the whole surface. Rays that miss
+    /// it are never tested against the shape, so it must not be smaller
+    /// than the shape. Infinite bounds mark an unbounded shape.
     virtual BBox get_bbox () const = 0;
+
+    /// Tells whether r hits the shape between r.tmin and r.tmax, without
+    /// finding the closest hit or computing any shading data.
+    /// The parameters self and inside_self are as for intersect.
+    /// The default falls back to intersect.
+    virtual bool occluded (const Ray& r, bool self, bool inside_self)
+    {
+        Ray r2 = r;
+        Isect isect;
+        return intersect(r2, &isect, self, inside_self);
+    }
+
+    /// Surface area in shape space, or zero if the shape can't be sampled.
+    virtual float area () const { return 0; }
+
+    /// Picks a point on the surface, uniformly by area in shape space.
+    /// Only valid if area() is nonzero.
+    /// @par n [out] geometric normal at the point
+    virtual vec3 sample (const vec2& u, vec3* n) const
+    {
+        throw std::runtime_error("Shape can't be sampled.");
+    }
 };
 
 
@@ -146,6 +262,17 @@ public:
     /// @param wi [out] entering vector in tangent space, normalized
     /// @return reflectance f(wo,wi)
     virtual Spectrum sample (const vec3& wo, vec3* wi, const vec2& uv, float* pdf) const = 0;
+
+    /// @return reflectance f(wo,wi) for directions in tangent space.
+    ///         Zero for specular BSDFs.
+    virtual Spectrum f (const vec3& wo, const vec3& wi) const = 0;
+
+    /// @return density of sample picking #wi given #wo
+    virtual float pdf (const vec3& wo, const vec3& wi) const = 0;
+
+    /// Specular BSDFs only reflect to a single direction, so light
+    /// sampling can't find it.
+    virtual bool is_specular () const { return false; }
 };
 
 
@@ -154,7 +281,8 @@ class Material
 public:
     virtual ~Material () {}
     // virtual std::unique_ptr<BSDF> get_bsdf (const vec3& p) const = 0;
-    virtual std::unique_ptr<BSDF> get_bsdf (const vec3& p, const vec2& u) const = 0;
+    /// The BSDF is created in #arena and lives until the arena is reset.
+    virtual BSDF* get_bsdf (const vec3& p, const vec2& u, MemoryArena& arena) const = 0;
 };
 
 class Primitive
@@ -164,10 +292,29 @@ public:
     /// @par prev The previous intersection (nullptr if r is a camera ray).
     ///           Used in surface acne prevention.
     virtual bool intersect (Ray& r, Isect* isect, const Isect* prev) const = 0;
+
+    /// Intersects the camera rays from #first on.
+    /// Sets hits[i] for the rays that hit and shortens their tmax.
+    virtual void intersect_packet (RayPacket& packet, int first, Isect* isects, bool* hits) const
+    {
+        for (int i = first; i < packet.size; i++) {
+            hits[i] |= intersect(packet.rays[i], &isects[i], nullptr);
+        }
+    }
+
+    /// World space bounds.
+    virtual BBox get_bbox () const = 0;
+
+    /// Tells whether anything is hit between r.tmin and r.tmax. Stops at
+    /// the first hit found, and computes no shading data.
+    /// @par prev As for intersect.
+    virtual bool occluded (const Ray& r, const Isect* prev) const = 0;
 };
 
 
 
+/// Tests every primitive one after another.
+/// Kept as a reference for checking the results of BVHAggregate.
 class ListAggregate : public Primitive
 {
 public:
@@ -186,6 +333,66 @@ public:
         }
         return hit;
     }
+
+    void intersect_packet (RayPacket& packet, int first, Isect* isects, bool* hits) const
+    {
+        for (auto& prim : prims) {
+            prim->intersect_packet(packet, first, isects, hits);
+        }
+    }
+
+    bool occluded (const Ray& r, const Isect* prev) const
+    {
+        for (auto& prim : prims) {
+            if (prim->occluded(r, prev)) return true;
+        }
+        return false;
+    }
+
+    BBox get_bbox () const
+    {
+        BBox b;
+        for (auto& prim : prims) {
+            b.extend(prim->get_bbox());
+        }
+        return b;
+    }
+};
+
+/// Bounding volume hierarchy over the world space bounds of the primitives.
+/// Primitives with unbounded extents (planes) are kept aside and tested
+/// linearly.
+class BVHAggregate : public Primitive
+{
+public:
+    BVHAggregate (const std::vector<std::shared_ptr<const Primitive>>& prims);
+
+    bool intersect (Ray& r, Isect* isect, const Isect* prev) const;
+
+    void intersect_packet (RayPacket& packet, int first, Isect* isects, bool* hits) const;
+
+    bool occluded (const Ray& r, const Isect* prev) const;
+
+    BBox get_bbox () const;
+
+private:
+    struct Node
+    {
+        BBox bbox;
+        /// Leaf: index of the first primitive. Interior: index of the second
+        /// child, the first child follows the node directly.
+        int offset;
+        /// Number of primitives, zero for interior nodes.
+        int count;
+        /// Split axis of an interior node.
+        int axis;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<std::shared_ptr<const Primitive>> prims;
+    std::vector<std::shared_ptr<const Primitive>> unbounded;
+
+    int build (std::vector<BBox>& bounds, int begin, int end);
 };
 
 class GeometricPrimitive : public Primitive
@@ -194,12 +401,58 @@ public:
     shared_ptr<Material> mat;
     shared_ptr<Shape> shape;
     Transform world_from_prim;
-    mutable Transform prim_from_world;
     Spectrum Le;
 
+    /// Caches the inverse transform and the world space bounds.
+    /// Must be called after world_from_prim, shape and Le have been set,
+    /// and before the first intersect.
+    void finalize ()
+    {
+        prim_from_world = inverse(world_from_prim);
+        BBox box = shape->get_bbox();
+        if (box.is_empty()) {
+            // The shape never computed its bounds. Treat it as unbounded
+            // rather than cull rays by a made-up box.
+            const float inf = std::numeric_limits<float>::infinity();
+            box = BBox(vec3(-inf), vec3(inf));
+        }
+        world_bbox = box.transform(world_from_prim);
+        bounded = world_bbox.is_finite();
+        shape_area = shape->area();
+        det = fabs(glm::determinant(glm::mat3(world_from_prim.m)));
+    }
+
+    /// Emissive primitives whose shape can be sampled are area lights.
+    bool is_light () const
+    {
+        return Le != Spectrum(0,0,0) && shape_area > 0;
+    }
+
+    /// Picks a point on the surface for light sampling.
+    /// @par n [out] world space geometric normal at the point
+    /// @par pdf [out] density of the point per world space area
+    vec3 sample_area (const vec2& u, vec3* n, float* pdf) const
+    {
+        vec3 n_prim;
+        vec3 p = shape->sample(u, &n_prim);
+        *n = normalize(world_from_prim.normal(n_prim));
+        *pdf = area_pdf(*n);
+        return world_from_prim.point(p);
+    }
+
+    /// Density of sample_area at a point whose geometric normal is #n.
+    float area_pdf (const vec3& n) const
+    {
+        // The points are uniform over the shape's own surface. A surface
+        // element with world normal n grows by |det M| / |M^T n| under
+        // world_from_prim, M being its linear part.
+        float stretch = det / length(prim_from_world.normal(n));
+        return 1 / (shape_area * stretch);
+    }
+
     bool intersect (Ray& r, Isect* isect, const Isect* prev) const
     {
-        prim_from_world = inverse(world_from_prim); // FIXME: dont do this every time!
+        if (bounded && !world_bbox.intersect(r)) return false;
 
         Ray ro = r.transform(prim_from_world);
         Isect is2;
@@ -219,11 +472,65 @@ public:
         r.tmax = ro.tmax;
         isect->p = world_from_prim.point(is2.p);
         isect->n = normalize(world_from_prim.normal(is2.n));
+        isect->ng = normalize(world_from_prim.normal(is2.ng));
         isect->mat = mat.get();
         isect->Le = Le;
         isect->prim = this;
         return true;
     }
+
+    bool occluded (const Ray& r, const Isect* prev) const
+    {
+        if (bounded && !world_bbox.intersect(r)) return false;
+
+        Ray ro = r.transform(prim_from_world);
+        if (prev && prev->prim == this) {
+            bool inside = ( dot(r.d, prev->n) < 0 );
+            return shape->occluded(ro, true, inside);
+        }
+        return shape->occluded(ro, false, false);
+    }
+
+    void intersect_packet (RayPacket& packet, int first, Isect* isects, bool* hits) const
+    {
+        if (bounded) {
+            first = packet.first_hit(world_bbox, first);
+            if (first == packet.size) return;
+        }
+
+        RayPacket local;
+        for (int i = first; i < packet.size; i++) {
+            local.add(packet.rays[i].transform(prim_from_world));
+        }
+        local.update_bounds();
+
+        Isect is2[RayPacket::max_size];
+        bool hit2[RayPacket::max_size] = {false};
+        shape->intersect_packet(local, 0, is2, hit2);
+
+        for (int i = first; i < packet.size; i++) {
+            int j = i - first;
+            if (!hit2[j]) continue;
+            packet.rays[i].tmax = local.rays[j].tmax;
+            isects[i].p = world_from_prim.point(is2[j].p);
+            isects[i].n = normalize(world_from_prim.normal(is2[j].n));
+            isects[i].ng = normalize(world_from_prim.normal(is2[j].ng));
+            isects[i].mat = mat.get();
+            isects[i].Le = Le;
+            isects[i].prim = this;
+            hits[i] = true;
+        }
+    }
+
+    BBox get_bbox () const { return world_bbox; }
+
+private:
+    Transform prim_from_world;
+    BBox world_bbox;
+    bool bounded;
+    float shape_area;
+    /// Determinant of the linear part of world_from_prim.
+    float det;
 };
 
 
@@ -273,6 +580,29 @@ public:
     {
         return sample(ray.d);
     }
+
+    /// Picks an incoming direction for light sampling.
+    /// Skylights that can't be importance sampled set *pdf to zero,
+    /// which is the default.
+    /// @par wi [out] world space direction towards the sky
+    /// @return radiance from direction wi
+    virtual Spectrum sample_direction (const vec2& u, vec3* wi, float* pdf) const
+    {
+        *pdf = 0;
+        return Spectrum(0.0f);
+    }
+
+    /// Solid angle density of sample_direction picking #wi.
+    virtual float pdf (const vec3& wi) const
+    {
+        return 0;
+    }
+
+    /// True if sample_direction importance samples the sky.
+    virtual bool can_sample () const
+    {
+        return false;
+    }
 };
 
 class Scene
@@ -281,11 +611,71 @@ public:
     shared_ptr<Primitive> primitives;
     shared_ptr<Camera> camera;
     shared_ptr<Skylight> skylight;
+    /// Emissive primitives that can be sampled by area. They are owned by
+    /// the primitives aggregate.
+    std::vector<const GeometricPrimitive*> lights;
 
     bool intersect (Ray& ray, Isect* isect, const Isect* prev) const
     {
         return primitives->intersect(ray, isect, prev);
     }
+
+    /// Visibility test for shadow rays.
+    bool occluded (const Ray& ray, const Isect* prev) const
+    {
+        return primitives->occluded(ray, prev);
+    }
+
+    /// Number of lights to pick from in light sampling: the area lights,
+    /// and the sky if it can be importance sampled.
+    int light_count () const
+    {
+        return lights.size() + (skylight->can_sample() ? 1 : 0);
+    }
+
+    /// Picks one of the lights uniformly, and a point or direction by that
+    /// light's own distribution, for next event estimation from #p.
+    /// @par shadow [out] the ray from #p to the sample, to test for occluders
+    /// @par Le     [out] radiance arriving along the shadow ray if it is clear
+    /// @return density per solid angle of the shadow ray's direction,
+    ///         the choice of the light included; zero if there is no sample
+    float sample_light (const vec3& p, vec2 u, Ray* shadow, Spectrum* Le) const
+    {
+        // Use the first dimension to pick the light, and stretch the part
+        // of it within the light's interval back to [0,1).
+        int count = light_count();
+        int index = std::min(int(u[0] * count), count - 1);
+        u[0] = std::min(u[0] * count - index, 1 - 1e-7f);
+
+        float light_pdf;
+        if (index < (int)lights.size()) {
+            const GeometricPrimitive* light = lights[index];
+            vec3 n;
+            float area_pdf;
+            vec3 q = light->sample_area(u, &n, &area_pdf);
+            light_pdf = area_to_solid_angle(area_pdf, p, q, n);
+            float dist = length(q - p);
+            // Stop just short of the light, which would otherwise hide itself.
+            *shadow = Ray(p, (q - p) / dist, 0, dist * (1 - shadow_epsilon));
+            *Le = light->Le;
+        }
+        else {
+            vec3 wi;
+            *Le = skylight->sample_direction(u, &wi, &light_pdf);
+            *shadow = Ray(p, wi);
+        }
+        if (*Le == Spectrum(0,0,0)) return 0;
+        return light_pdf / count;
+    }
+
+    /// Relative length by which shadow rays fall short of area lights.
+    static constexpr float shadow_epsilon = 1e-3f;
+
+    /// Intersects a packet of camera rays. hits must be cleared by the caller.
+    void intersect_packet (RayPacket& packet, Isect* isects, bool* hits) const
+    {
+        primitives->intersect_packet(packet, 0, isects, hits);
+    }
 };
 
 class SurfaceIntegrator
@@ -293,9 +683,20 @@ class SurfaceIntegrator
 public:
     /// The outgoing radiance along the ray,
     /// or the incoming radiance at the ray origin.
-    virtual Spectrum Li (Ray& ray, const Scene* scene, Sample& sample, const Isect* prev=nullptr) = 0;
-
-    static SurfaceIntegrator* make ();
+    /// The BSDFs along the path are created in #arena; the caller resets
+    /// it once the sample is done.
+    virtual Spectrum Li (Ray& ray, const Scene* scene, Sample& sample, MemoryArena& arena,
+                         const Isect* prev=nullptr) = 0;
+
+    /// Same as Li for a camera ray whose first intersection has already
+    /// been found, e.g. by tracing a RayPacket. Later bounces are traced
+    /// one ray at a time.
+    virtual Spectrum Li (Ray& ray, const Scene* scene, Sample& sample, MemoryArena& arena,
+                         bool hit, const Isect& isect) = 0;
+
+    /// @par max_depth  Maximum number of bounces.
+    /// @par rr_depth   Number of bounces before Russian roulette starts.
+    static SurfaceIntegrator* make (int max_depth, int rr_depth);
 };
 
 
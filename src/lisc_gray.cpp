@@ -85,6 +85,7 @@ void evaluate_prim (Value& val, List& args)
     //     p->world_from_prim = p->world_from_prim * Transform::scale(vec3(scale));
     // }
 
+    p->finalize();
 
 
     std::shared_ptr<Primitive> sh(dynamic_cast<Primitive*>(p));
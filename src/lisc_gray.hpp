@@ -7,5 +7,10 @@
 bool evaluate_gray (Value& val, const std::string& name, List& args);
 
 Transform pop_transforms (List& args);
+
+/// Meshes loaded from PLY files are cached in #dir, with their BVHs, and
+/// later runs load them from there as long as the source is unchanged.
+/// An empty #dir turns the cache off.
+void set_mesh_cache_dir (const std::string& dir);
  
 #endif /* end of include guard: LISC_GRAY_H__ */
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include "timer.hpp"
 #include "malloc.hpp"
 #include "renderjob.hpp"
+#include "preview.hpp"
 
 class Texture
 {
@@ -64,85 +65,159 @@ public:
     int terminated;
     int arrived;
 
-    PathIntegrator ()
-        : rays(0), terminated(0), arrived(0)
+    /// @par max_depth  Maximum number of bounces.
+    /// @par rr_depth   Number of bounces before Russian roulette starts.
+    PathIntegrator (int max_depth, int rr_depth)
+        : rays(0), terminated(0), arrived(0),
+        max_depth(max_depth), rr_depth(rr_depth)
     { }
 
-    virtual Spectrum Li (Ray& ray, const Scene* scene, Sample& sample, const Isect* prev)
+    virtual Spectrum Li (Ray& ray, const Scene* scene, Sample& sample, MemoryArena& arena,
+                         const Isect* prev)
     {
-        debug::up();
+        rays++;
+        Isect isect;
+        bool hit = scene->intersect(ray, &isect, prev);
+        return trace(ray, scene, sample, arena, hit, isect);
+    }
 
-        debug::add("------------------------------------------", 0);
-        debug::add("Li: ray.o", ray.o);
-        debug::add("Li: ray.d", ray.d);
+    virtual Spectrum Li (Ray& ray, const Scene* scene, Sample& sample, MemoryArena& arena,
+                         bool hit, const Isect& isect)
+    {
+        rays++;
+        return trace(ray, scene, sample, arena, hit, isect);
+    }
 
-        constexpr float russian_p = 0.99;
-        if (sample.randf() > russian_p) {
-            terminated++;
-            debug::down();
-            return Spectrum(0.0f);
-        }
+private:
+    int max_depth;
+    int rr_depth;
 
-        rays++;
+    /// Follows the path iteratively, starting from the first intersection.
+    Spectrum trace (const Ray& camera_ray, const Scene* scene, Sample& sample, MemoryArena& arena,
+                    bool hit, Isect isect)
+    {
+        debug::add("------------------------------------------", 0);
+        debug::add("Li: ray.o", camera_ray.o);
+        debug::add("Li: ray.d", camera_ray.d);
+
+        Spectrum L(0.0f);
+        // Path throughput: the product of f cos / pdf over the bounces so far.
+        Spectrum beta(1.0f);
+        Ray ray = camera_ray;
+        // Density of the BSDF sample that gave the ray, or zero if the
+        // lights could not have been sampled from its origin.
+        float bsdf_pdf = 0;
+        int light_count = scene->light_count();
+
+        for (int depth = 0; ; depth++) {
+            if (!hit) {
+                // The ray did not hit the scene.
+                // -------------------------------
+                // If the sky was also light sampled at the previous vertex,
+                // weight the two estimates.
+                float w = 1;
+                if (bsdf_pdf > 0) {
+                    w = power_heuristic(bsdf_pdf, scene->skylight->pdf(ray.d) / light_count);
+                }
+                L += beta * scene->skylight->sample(ray) * w;
+                break;
+            }
 
-        Spectrum L;
-        Spectrum Le(0.0f);
-        Isect isect;
-        if (scene->intersect(ray, &isect, prev)) {
             debug::add("Li: ray.t", ray.tmax);
             debug::add("Li: isect.p", isect.p);
             debug::add("Li: isect.n", isect.n);
 
             // The ray hit a point in the scene.
             // ----------------------------------
-            std::unique_ptr<BSDF> bsdf = isect.mat->get_bsdf(isect.p, sample.rand2f());
+            if (isect.Le != Spectrum(0,0,0)) {
+                // Same as for the sky, if the point could have been picked
+                // by light sampling.
+                // Only GeometricPrimitives report intersections.
+                auto* light = static_cast<const GeometricPrimitive*>(isect.prim);
+                float w = 1;
+                if (bsdf_pdf > 0 && light->is_light()) {
+                    float light_pdf = area_to_solid_angle(light->area_pdf(isect.ng),
+                                                          ray.o, isect.p, isect.ng);
+                    w = power_heuristic(bsdf_pdf, light_pdf / light_count);
+                }
+                L += beta * isect.Le * w;
+            }
+            if (depth >= max_depth) break;
+
+            const BSDF* bsdf = isect.mat->get_bsdf(isect.p, sample.rand2f(), arena);
             Transform tangent_from_world = build_tangent_from_world(isect.n);
             vec3 wo_t = tangent_from_world.vector(-ray.d);
             vec3 wi_t;
             float pdf;
-            debug::add("Li: wo_t", wo_t);
-            debug::add("Li: wi_t", wi_t);
-
             Spectrum f = bsdf->sample(wo_t, &wi_t, sample.get2d(), &pdf);
-            if (f == Spectrum(0,0,0)) {
+            vec2 light_sample = sample.get2d();
+            if (!bsdf->is_specular() && light_count > 0) {
+                L += beta * sample_light(scene, bsdf, isect, tangent_from_world, wo_t, light_sample);
+            }
+            if (f == Spectrum(0,0,0) || pdf == 0) {
                 // e.g. transmission when total internal reflection occurs
-                debug::down();
-                return Spectrum(0,0,0);
+                break;
             }
             vec3 wi = inverse(tangent_from_world).vector(wi_t);
-
-            debug::add("Li: wo", -ray.d);
-            debug::add("Li: wi", wi);
-            Ray newray = Ray(isect.p, wi);
-            Spectrum Li = this->Li(newray, scene, sample, &isect);
+            bsdf_pdf = bsdf->is_specular() ? 0 : pdf;
 
             // Light transport equation.
-            L = isect.Le + f * Li * abs_cos_theta(wi_t) / pdf;
-            debug::add("Le", Le);
+            beta *= f * abs_cos_theta(wi_t) / pdf;
+            debug::add("Li: wo_t", wo_t);
+            debug::add("Li: wi_t", wi_t);
             debug::add("f", f);
-            debug::add("Li", Li);
             debug::add("cos", abs_cos_theta(wi_t));
             debug::add("pdf", pdf);
-            debug::add("f cos pdf", f * abs_cos_theta(wi_t) / pdf);
-            debug::add("isect.p", isect.p);
-            debug::add("ray.d", ray.d);
-        }
-        else {
-            // The ray did not hit the scene.
-            // -------------------------------
-            L = scene->skylight->sample(ray);
+            debug::add("beta", beta);
+
+            // Russian roulette on the throughput, so that dim paths are
+            // cut early and bright ones are followed further.
+            if (depth + 1 >= rr_depth) {
+                float p = std::min(1.0f, std::max(beta.x, std::max(beta.y, beta.z)));
+                if (sample.randf() >= p) {
+                    terminated++;
+                    break;
+                }
+                beta /= p;
+            }
+
+            Isect prev = isect;
+            ray = Ray(isect.p, wi);
+            rays++;
+            hit = scene->intersect(ray, &isect, &prev);
         }
 
-        L = L / russian_p;
         debug::add("-- L", L);
-        debug::down();
         return L;
     }
+
+    /// Next event estimation: the light arriving from one light, picked
+    /// uniformly from the scene's lights, at a point or direction picked by
+    /// the light's own distribution. Weighted against BSDF sampling.
+    Spectrum sample_light (const Scene* scene, const BSDF* bsdf, const Isect& isect,
+                           const Transform& tangent_from_world, const vec3& wo_t,
+                           const vec2& u)
+    {
+        Ray shadow;
+        Spectrum Le;
+        float light_pdf = scene->sample_light(isect.p, u, &shadow, &Le);
+        if (light_pdf == 0) return Spectrum(0.0f);
+
+        vec3 wi_t = tangent_from_world.vector(shadow.d);
+        Spectrum f = bsdf->f(wo_t, wi_t);
+        if (f == Spectrum(0,0,0)) return Spectrum(0.0f);
+
+        rays++;
+        if (scene->occluded(shadow, &isect)) return Spectrum(0.0f);
+
+        float w = power_heuristic(light_pdf, bsdf->pdf(wo_t, wi_t));
+        return f * Le * abs_cos_theta(wi_t) * (w / light_pdf);
+    }
 };
 
-SurfaceIntegrator* SurfaceIntegrator::make ()
+SurfaceIntegrator* SurfaceIntegrator::make (int max_depth, int rr_depth)
 {
-    return new PathIntegrator();
+    return new PathIntegrator(max_depth, rr_depth);
 }
 
 
@@ -150,7 +225,8 @@ SurfaceIntegrator* SurfaceIntegrator::make ()
 #include "lisc_gray.hpp"
 #include "lisc_linalg.hpp"
 
-Scene* evaluate_scene (Value& description) {
+/// @par accel  Name of the top level aggregate: "bvh" or "list".
+Scene* evaluate_scene (Value& description, const std::string& accel) {
     auto e = Evaluator();
     e.add_set(evaluate_linalg);
     e.add_set(evaluate_gray);
@@ -159,21 +235,35 @@ Scene* evaluate_scene (Value& description) {
     // std::cout << description << std::endl;
 
     Scene* scene = new Scene();
-    std::shared_ptr<ListAggregate> agg = std::make_shared<ListAggregate>();
+    std::vector<std::shared_ptr<const Primitive>> prims;
     std::shared_ptr<Primitive> p = nullptr;
     while ( (p = pop_attr<Primitive>("_prim", nullptr, description.list)) ) {
-        agg->add(p);
+        prims.push_back(p);
+    }
+    for (auto& prim : prims) {
+        auto* gp = dynamic_cast<const GeometricPrimitive*>(prim.get());
+        if (gp && gp->is_light()) scene->lights.push_back(gp);
+    }
+    if (accel == "bvh") {
+        scene->primitives = std::make_shared<BVHAggregate>(prims);
+    }
+    else if (accel == "list") {
+        auto agg = std::make_shared<ListAggregate>();
+        for (auto& prim : prims) agg->add(prim);
+        scene->primitives = agg;
+    }
+    else {
+        throw std::range_error("Bad aggregate name.");
     }
-    scene->primitives = agg;
     scene->camera = pop_attr<Camera>("_camera", description.list);
     scene->skylight = pop_attr<Skylight>("_skylight", description.list);
     return scene;
 }
 
-Scene* load (const char* filename)
+Scene* load (const char* filename, const std::string& accel)
 {
     Value w( parse_file(filename) );
-    return evaluate_scene(w);
+    return evaluate_scene(w, accel);
 }
 
 
@@ -190,6 +280,29 @@ int main (int argc, char* argv[])
     const char* input_filename = "test1.lisc";
     const char* output_filename = "out";
     std::string sampler_name = "random";
+    std::string accel_name = "bvh";
+    int packet_size = 0;
+    int max_depth = 64;
+    int rr_depth = 3;
+    std::string engine = "path";
+    std::string film_mode = "direct";
+    std::string filter_name = "box";
+    int progressive_spp = 0;
+    double time_budget = 0;
+    float noise_threshold = 0;
+    float adaptive_threshold = 0;
+    unsigned int seed = 14217;
+    int frame = 0;
+    const char* resume_filename = nullptr;
+    double checkpoint_interval = 0;
+    std::vector<const char*> merge_filenames;
+    int shard_index = 0;
+    int shard_count = 1;
+    const char* exr_name = nullptr;
+    double preview_interval = 2.0;
+    const char* cache_dir = nullptr;
+    bool png = false;
+    ToneMap tonemap;
 
     for (int i = 1; i < argc; ++i)
     {
@@ -223,6 +336,76 @@ int main (int argc, char* argv[])
         else if (strcmp(argv[i], "--sampler") == 0) {
             sampler_name = std::string(argv[++i]);
         }
+        else if (strcmp(argv[i], "--accel") == 0) {
+            accel_name = std::string(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--packet") == 0) {
+            packet_size = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--max-depth") == 0) {
+            max_depth = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rr-depth") == 0) {
+            rr_depth = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--engine") == 0) {
+            engine = std::string(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--film") == 0) {
+            film_mode = std::string(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--filter") == 0) {
+            filter_name = std::string(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--progressive") == 0) {
+            progressive_spp = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--time-budget") == 0) {
+            time_budget = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--noise") == 0) {
+            noise_threshold = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0) {
+            adaptive_threshold = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0) {
+            seed = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--frame") == 0) {
+            frame = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--resume") == 0) {
+            resume_filename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0) {
+            checkpoint_interval = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--merge") == 0) {
+            merge_filenames.push_back(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--preview") == 0) {
+            preview_interval = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--cache") == 0) {
+            cache_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--png") == 0) {
+            png = true;
+        }
+        else if (strcmp(argv[i], "--exposure") == 0) {
+            tonemap.exposure = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gamma") == 0) {
+            tonemap.gamma = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--exr") == 0) {
+            exr_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "--shard") == 0) {
+            shard_index = atol(argv[++i]);
+            shard_count = atol(argv[++i]);
+        }
         else {
             input_filename = argv[i];
         }
@@ -233,28 +416,142 @@ int main (int argc, char* argv[])
 #endif
 
     try {
+        char filename[256];
+        // Fail on a bad name before rendering rather than after.
+        if (exr_name) exr_compression(exr_name);
+        if (engine == "wavefront" && packet_size > 0) {
+            throw std::range_error("The wavefront engine doesn't trace packets.");
+        }
+
+        // Merge mode adds up the accumulation files of partial renders,
+        // such as the shards of a frame or runs with different seeds,
+        // without rendering anything.
+        if (!merge_filenames.empty()) {
+            Film merged(1, 1);
+            RenderProgress part_progress;
+            merged.load_accumulation(merge_filenames[0], &part_progress);
+            // The shards of a render share its seed and cover different
+            // tiles, so their samples per pixel don't add up. Runs with
+            // different seeds cover the same pixels with independent
+            // samples, so theirs do. runs has the furthest piece of each seed.
+            std::vector<RenderProgress> runs(1, part_progress);
+            for (size_t i = 1; i < merge_filenames.size(); i++) {
+                Film part(1, 1);
+                part.load_accumulation(merge_filenames[i], &part_progress);
+                if (part.xres != merged.xres || part.yres != merged.yres ||
+                    part.filter != merged.filter) {
+                    throw std::range_error(std::string("Film of ") + merge_filenames[i] +
+                                           " doesn't match the others.");
+                }
+                if (part_progress.frame != runs[0].frame) {
+                    throw std::range_error(std::string(merge_filenames[i]) +
+                                           " is of another frame than the others.");
+                }
+                merged.merge(part, 0, 0);
+                auto run = std::find_if(runs.begin(), runs.end(), [&](const RenderProgress& r) {
+                    return r.seed == part_progress.seed;
+                });
+                if (run == runs.end()) {
+                    runs.push_back(part_progress);
+                }
+                else {
+                    run->pass = std::max(run->pass, part_progress.pass);
+                    run->spp = std::max(run->spp, part_progress.spp);
+                }
+            }
+            RenderProgress progress = runs[0];
+            if (runs.size() > 1) {
+                // Resuming with the seed of any of the runs would repeat
+                // its samples, so the merged film gets a seed of its own
+                // and starts over from the first pass.
+                uint64_t h = 0;
+                progress.pass = 0;
+                progress.spp = 0;
+                for (auto& r : runs) {
+                    h = mix_bits(h ^ r.seed);
+                    progress.spp += r.spp;
+                }
+                progress.seed = (unsigned int)h;
+            }
+            printf("Merged %d films of %d x %d, %d spp from %d seeds\n", (int)merge_filenames.size(),
+                   merged.xres, merged.yres, progress.spp, (int)runs.size());
+            sprintf(filename, "%s.float", output_filename);
+            merged.save_float(filename);
+            sprintf(filename, "%s.hdr", output_filename);
+            merged.save_rgbe(filename);
+            if (png) {
+                sprintf(filename, "%s.png", output_filename);
+                merged.save(filename, tonemap, thread_count);
+            }
+            if (exr_name) {
+                sprintf(filename, "%s.exr", output_filename);
+                merged.save_exr(filename, exr_compression(exr_name), thread_count);
+            }
+            sprintf(filename, "%s.acc", output_filename);
+            merged.save_accumulation(filename, progress);
+            return 0;
+        }
+
         std::unique_ptr<Scene> scene = nullptr;
         Timer load_timer;
 
         load_timer.start();
-        scene.reset(load(input_filename));
+        if (cache_dir) set_mesh_cache_dir(cache_dir);
+        scene.reset(load(input_filename, accel_name));
         load_timer.stop();
 
         printf("Resolution: %d x %d\n", resx, resy);
         printf("Samples per pixel: %d\n", spp);
 
-        Film wholefilm(resx, resy);
+        Film::Filter filter;
+        if (filter_name == "box") {
+            filter = Film::BOX;
+        }
+        else if (filter_name == "tent") {
+            filter = Film::TENT;
+        }
+        else {
+            throw std::range_error("Bad filter name.");
+        }
+        // A tile film can't hold the samples that a wider filter spreads
+        // over the neighbouring tiles.
+        if (film_mode == "merge" && filter != Film::BOX) {
+            throw std::range_error("Film mode merge needs the box filter.");
+        }
+        Film wholefilm(resx, resy, filter);
+        // A resumed render carries on from the passes in the file, with
+        // the seed and frame it was started with.
+        RenderProgress progress = { 0, 0, seed, frame };
+        if (resume_filename) {
+            wholefilm.load_accumulation(resume_filename, &progress);
+            if (wholefilm.xres != resx || wholefilm.yres != resy || wholefilm.filter != filter) {
+                throw std::range_error("Film to resume doesn't match the resolution or filter.");
+            }
+            printf("Resuming at pass %d, %d spp\n", progress.pass, progress.spp);
+        }
         threaded_render::Job job(thread_count, *scene, wholefilm);
+        job.seed = progress.seed;
+        job.frame = progress.frame;
         std::vector<threaded_render::TaskDesc> tasks;
         if (single_block_x != -1) {
             tasks.push_back(threaded_render::TaskDesc{
                             single_block_x, single_block_y,
                             block_size, block_size,
-                            spp, sampler_name});
+                            spp, sampler_name, packet_size,
+                            max_depth, rr_depth, engine,
+                            film_mode, 0, 0});
         }
         else {
+            if (shard_count < 1 || shard_index < 0 || shard_index >= shard_count) {
+                throw std::range_error("Bad shard.");
+            }
+            // A shard renders every shard_count'th tile. Pixels are seeded
+            // independently of the tiles, so the merged shards are the
+            // same as the whole frame rendered at once.
+            int tile_index = 0;
             for (int by = 0; by < (resy + block_size-1) / block_size; by++) {
                 for (int bx = 0; bx < (resx + block_size-1) / block_size; bx++) {
+                    if (tile_index++ % shard_count != shard_index) continue;
                     int xofs = bx * block_size;
                     int yofs = by * block_size;
                     int xsize = (resx - xofs < block_size) ? resx - xofs : block_size;
@@ -262,7 +559,9 @@ int main (int argc, char* argv[])
                     tasks.push_back(threaded_render::TaskDesc{
                                     xofs, yofs,
                                     xsize, ysize,
-                                    spp, sampler_name});
+                                    spp, sampler_name, packet_size,
+                                    max_depth, rr_depth, engine,
+                                    film_mode, 0, 0});
                 }
             }
         }
@@ -274,24 +573,94 @@ int main (int argc, char* argv[])
 
         Timer render_timer;
         Timer preview_timer;
+        size_t allocs_before_render = get_total_mem_allocs();
         render_timer.start();
 
+        // In progressive mode the tiles are rendered over and over in passes
+        // of progressive_spp samples, so that the whole image converges
+        // together, until spp is reached, the time budget runs out or the
+        // image is below the noise threshold. Otherwise there is one pass.
+        int pass_spp = (progressive_spp > 0) ? progressive_spp : spp;
         int total_tasks = tasks.size();
         int completed_tasks = 0;
+        int pass = progress.pass;
+        int rendered_spp = progress.spp;
+        // Checkpoints are written between passes, when no tile is half
+        // done.
+        Timer checkpoint_timer;
+        auto save_checkpoint = [&]() {
+            progress.pass = pass;
+            progress.spp = rendered_spp;
+            sprintf(filename, "%s.acc", output_filename);
+            wholefilm.save_accumulation(filename, progress);
+        };
+        // The callback runs on the worker threads, so it only copies the
+        // finished tile and asks for the previews, and the writer makes
+        // them on a thread of its own.
+        PreviewWriter preview(wholefilm, output_filename, png, tonemap);
         job.set_callback([&](const threaded_render::Task& task) {
             ++completed_tasks;
-            if (preview_timer.snap() > 2.0) {
-                std::cout << "completed: " << completed_tasks << " / " << total_tasks << "\r";
-                char filename[256];
-                sprintf(filename, "%s.hdr", output_filename);
-                wholefilm.save_rgbe(filename);
+            if (preview_interval <= 0) return;
+            preview.tile_finished(task.xofs, task.yofs, task.xres, task.yres);
+            if (preview_timer.snap() > preview_interval) {
+                std::cout << "pass " << pass << " completed: " << completed_tasks << " / " << total_tasks << "\r";
+                preview.request();
                 preview_timer.start();
             }
         });
-        for (auto& t : tasks) {
-            job.add_task(t);
+        // With adaptive sampling, after the first pass only the tiles whose
+        // relative error is above the threshold get more samples.
+        if (adaptive_threshold > 0 && progressive_spp == 0) {
+            throw std::range_error("Adaptive sampling needs --progressive.");
+        }
+        // The samplers are made on the worker threads, where a spp the
+        // sampler can't take would abort the process, so try every pass
+        // size here first. Only the last pass can be shorter.
+        if (rendered_spp < spp) {
+            using threaded_render::make_sampler;
+            int remaining = spp - rendered_spp;
+            std::unique_ptr<SampleGenerator> check(make_sampler(sampler_name, std::min(pass_spp, remaining)));
+            if (remaining % pass_spp != 0) {
+                check.reset(make_sampler(sampler_name, remaining % pass_spp));
+            }
+        }
+        double samples = 0;
+        while (rendered_spp < spp) {
+            int n = std::min(pass_spp, spp - rendered_spp);
+            completed_tasks = 0;
+            total_tasks = 0;
+            for (auto& t : tasks) {
+                if (pass > 0 && adaptive_threshold > 0 &&
+                    wholefilm.relative_error(t.xofs, t.yofs, t.xres, t.yres) <= adaptive_threshold) {
+                    continue;
+                }
+                t.spp = n;
+                t.pass = pass;
+                t.first_sample = rendered_spp;
+                job.add_task(t);
+                total_tasks++;
+                samples += (double)t.xres * t.yres * n;
+            }
+            if (total_tasks == 0) break;
+            job.finish();
+            rendered_spp += n;
+            pass++;
+
+            if (checkpoint_interval > 0 && checkpoint_timer.snap() >= checkpoint_interval &&
+                rendered_spp < spp) {
+                save_checkpoint();
+                checkpoint_timer.start();
+            }
+
+            if (progressive_spp > 0) {
+                float error = wholefilm.relative_error();
+                std::cout << "pass " << pass << ": " << rendered_spp << " spp, "
+                          << total_tasks << " tiles, "
+                          << render_timer.snap() << "s, relative error " << error << std::endl;
+                if (time_budget > 0 && render_timer.snap() >= time_budget) break;
+                if (noise_threshold > 0 && error <= noise_threshold) break;
+            }
         }
-        job.finish();
         render_timer.stop();
 
         // int paths = wholefilm.xres*wholefilm.yres*spp;
@@ -304,17 +673,38 @@ int main (int argc, char* argv[])
         // // printf("Paths terminated: %d (%.0f%%)\n", surf_integ->terminated, surf_integ->terminated / (float)paths * 100);
         // // printf("Avg rays/path: %.1f\n", (float)surf_integ->rays / paths);
 
+        // The final images go to the same files as the previews.
+        preview.finish();
+
         std::cout << std::endl;
         std::cout << "Loading time   " << load_timer << std::endl;
         std::cout << "Rendering time " << render_timer << std::endl;
+        std::cout << "Average samples per pixel " << samples / ((double)resx * resy) << std::endl;
+        std::cout << "Previews " << preview.written() << ", workers waited "
+                  << job.callback_seconds() << "s" << std::endl;
+#ifdef WRAP_MALLOC
+        // Includes the per-task and preview allocations, so this should
+        // stay well below one. A resumed render that was already done
+        // takes no samples.
+        if (samples > 0) {
+            std::cout << "Heap allocations per sample "
+                      << (get_total_mem_allocs() - allocs_before_render) / samples << std::endl;
+        }
+#endif
 
-        char filename[256];
-        // sprintf(filename, "%s.png", output_filename);
-        // wholefilm.save(filename);
+        if (png) {
+            sprintf(filename, "%s.png", output_filename);
+            wholefilm.save(filename, tonemap, thread_count);
+        }
         sprintf(filename, "%s.float", output_filename);
         wholefilm.save_float(filename);
         sprintf(filename, "%s.hdr", output_filename);
         wholefilm.save_rgbe(filename);
+        if (exr_name) {
+            sprintf(filename, "%s.exr", output_filename);
+            wholefilm.save_exr(filename, exr_compression(exr_name), thread_count);
+        }
+        save_checkpoint();
 
     }
     catch (const std::exception& e) {
@@ -88,7 +88,9 @@ void* __wrap_realloc(void* oldptr, size_t size)
     
     void* p = (char*)oldptr-16;
 
-    void* new_p = __real_realloc(p, size);
+    // The size is stored in front of the block, so the block must keep
+    // its 16 extra bytes.
+    void* new_p = __real_realloc(p, size+16);
     if (new_p == nullptr) {
 #ifdef DEBUG_MALLOC
         printf("MALLOC: %p : %lld realloc\n", (char*)oldptr, size);
@@ -97,11 +99,10 @@ void* __wrap_realloc(void* oldptr, size_t size)
     }
 
     size_t old_size = *(size_t*)new_p;
-    if (old_size > size) {
-        mem_usage -= old_size;
-        mem_usage += size;
-        *(size_t*)new_p = size;
-    }
+    mem_usage -= old_size;
+    mem_usage += size;
+    if (size > old_size) total_mem_usage += size - old_size;
+    *(size_t*)new_p = size;
 
 #ifdef DEBUG_MALLOC
     printf("MALLOC: %p : %lld realloc %lld\n", (char*)oldptr, size, old_size);
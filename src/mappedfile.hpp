@@ -0,0 +1,58 @@
+#ifndef _MAPPEDFILE_HPP_
+#define _MAPPEDFILE_HPP_
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Read-only memory mapping of a whole file. Pages are read in by the OS
+/// as they are first touched, so parsers can work on the file in place
+/// without copying it into a buffer first.
+class MappedFile
+{
+public:
+    explicit MappedFile (const std::string& filename)
+        : ptr(nullptr), len(0)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("cannot open " + filename);
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            throw std::runtime_error("cannot stat " + filename);
+        }
+        len = st.st_size;
+        if (len > 0) {
+            void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("cannot map " + filename);
+            }
+            // Files are mostly read front to back, once.
+            madvise(p, len, MADV_SEQUENTIAL);
+            ptr = static_cast<const char*>(p);
+        }
+        close(fd);
+    }
+
+    ~MappedFile ()
+    {
+        if (ptr) munmap(const_cast<char*>(ptr), len);
+    }
+
+    MappedFile (const MappedFile&) = delete;
+    MappedFile& operator= (const MappedFile&) = delete;
+
+    const char* data () const { return ptr; }
+    size_t size () const { return len; }
+
+private:
+    const char* ptr;
+    size_t len;
+};
+
+#endif // _MAPPEDFILE_HPP_
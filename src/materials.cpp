@@ -162,10 +162,20 @@ public:
 
     virtual Spectrum sample (const vec3& wo, vec3* wi, const vec2& uv, float* pdf) const
     {
-        *wi = uniform_sample_hemisphere(uv);
-        *pdf = uniform_hemisphere_pdf();
+        *wi = cosine_sample_hemisphere(uv);
+        *pdf = cosine_hemisphere_pdf(wi->z);
         return rho / (float)M_PI;
     }
+
+    virtual Spectrum f (const vec3& wo, const vec3& wi) const
+    {
+        return (wi.z > 0) ? rho / (float)M_PI : Spectrum(0.0f);
+    }
+
+    virtual float pdf (const vec3& wo, const vec3& wi) const
+    {
+        return (wi.z > 0) ? cosine_hemisphere_pdf(wi.z) : 0;
+    }
 };
 
 class Specular : public BSDF
@@ -180,16 +190,19 @@ public:
         *pdf = 1;
         return rho / abs_cos_theta(*wi);
     }
+
+    virtual Spectrum f (const vec3& wo, const vec3& wi) const { return Spectrum(0.0f); }
+    virtual float pdf (const vec3& wo, const vec3& wi) const { return 0; }
+    virtual bool is_specular () const { return true; }
 };
 
 class SpecularReflection : public BSDF
 {
 public:
     Spectrum R;
-    // TODO: shared_ptr might be a bit overkill here...
-    shared_ptr<Fresnel> fresnel;
+    const Fresnel* fresnel;
 
-    SpecularReflection (const Spectrum& R, const shared_ptr<Fresnel>& f)
+    SpecularReflection (const Spectrum& R, const Fresnel* f)
         : R(R), fresnel(f)
     { }
 
@@ -199,6 +212,10 @@ public:
         *pdf = 1;
         return (*fresnel)(cos_theta(wo)) * R / abs_cos_theta(*wi);
     }
+
+    virtual Spectrum f (const vec3& wo, const vec3& wi) const { return Spectrum(0.0f); }
+    virtual float pdf (const vec3& wo, const vec3& wi) const { return 0; }
+    virtual bool is_specular () const { return true; }
 };
 
 class SpecularTransmission : public BSDF
@@ -206,9 +223,9 @@ class SpecularTransmission : public BSDF
 public:
     // transmission scale factor
     Spectrum T;
-    shared_ptr<FresnelDielectric> fresnel;
+    const FresnelDielectric* fresnel;
 
-    SpecularTransmission (const Spectrum& T, shared_ptr<FresnelDielectric> f)
+    SpecularTransmission (const Spectrum& T, const FresnelDielectric* f)
         : T(T), fresnel(f)
     { }
 
@@ -262,6 +279,10 @@ public:
 
         return (eta*eta) * (Spectrum(1) - (*fresnel)(cos_i)) * T / abs_cos_theta(*wi);
     }
+
+    virtual Spectrum f (const vec3& wo, const vec3& wi) const { return Spectrum(0.0f); }
+    virtual float pdf (const vec3& wo, const vec3& wi) const { return 0; }
+    virtual bool is_specular () const { return true; }
 };
 
 
@@ -280,6 +301,20 @@ public:
     float A, B;
 
     virtual Spectrum sample (const vec3& wo, vec3* wi, const vec2& uv, float* pdf) const
+    {
+        if (wo.z <= 0) {
+            *pdf = 0;
+            return Spectrum(0);
+        }
+
+        // The cosine factor of the integrand cancels, and what is left of
+        // f varies slowly.
+        *wi = cosine_sample_hemisphere(uv);
+        *pdf = cosine_hemisphere_pdf(wi->z);
+        return f(wo, *wi);
+    }
+
+    virtual Spectrum f (const vec3& wo, const vec3& wi) const
     {
         // a = max(theta_i, theta_o)
         // b = min(theta_i, theta_o)
@@ -289,41 +324,45 @@ public:
         //    [ cos(x-y) = cos x cos y + sin x sin y ]
         //
 
-        if (wo.z <= 0) return Spectrum(0);
+        if (wo.z <= 0 || wi.z <= 0) return Spectrum(0);
 
-        *wi = uniform_sample_hemisphere(uv);
-        *pdf = uniform_hemisphere_pdf();
-        
         // cos X < cos Y  <==> X > Y
-        bool igto = cos_theta(*wi) < cos_theta(wo);
-        float sin_a = igto ? sin_theta(*wi) : sin_theta(wo);
-        float tan_b = igto ? tan_theta(wo) : tan_theta(*wi);
+        bool igto = cos_theta(wi) < cos_theta(wo);
+        float sin_a = igto ? sin_theta(wi) : sin_theta(wo);
+        float tan_b = igto ? tan_theta(wo) : tan_theta(wi);
 
-        float c = cos_phi(*wi)*cos_phi(wo) + sin_phi(*wi)*sin_phi(wo);
-        // float c = cos_phi(*wi)*cos_phi(wo)*1 + 1*sin_phi(*wi)*sin_phi(wo);
+        float c = cos_phi(wi)*cos_phi(wo) + sin_phi(wi)*sin_phi(wo);
+        // float c = cos_phi(wi)*cos_phi(wo)*1 + 1*sin_phi(wi)*sin_phi(wo);
         // c = c*sin_a*tan_b;
 
         float term = (A + B * std::max(0.0f, c) * sin_a * tan_b);
 
         debug::add("wo", wo);
-        debug::add("wi", *wi);
+        debug::add("wi", wi);
         debug::add("c", c);
         debug::add("sin_a", sin_a);
         debug::add("tan_b", tan_b);
 
         return term * rho / (float)M_PI;
     }
+
+    virtual float pdf (const vec3& wo, const vec3& wi) const
+    {
+        return (wo.z > 0 && wi.z > 0) ? cosine_hemisphere_pdf(wi.z) : 0;
+    }
 };
 
 class TorranceSparrow : public BSDF
 {
 public:
     TorranceSparrow (const Spectrum& rho)
-        : rho(rho)
+        : rho(rho), exponent(140)
     { }
 
     /// reflectance
     Spectrum rho;
+    /// Exponent of the Blinn microfacet distribution. Higher is shinier.
+    float exponent;
 
     virtual Spectrum sample (const vec3& wo, vec3* wi, const vec2& uv, float* pdf) const
     {
@@ -342,25 +381,60 @@ public:
         //                              wo . wh           wo . wh
         //            = min(1, 2*wh.z/(wo . wh) * min(wo.z, wi.z))
         
-        // Reflected ray
-        // *wi = normalize(vec3(-wo.x, -wo.y, wo.z)+.1f*vec3(frand()-.5,frand()-.5,frand()-.5));//uniform_sample_hemisphere(uv);
-        *wi = uniform_sample_hemisphere(uv);
-        *pdf = uniform_hemisphere_pdf();
+        // Sample the microfacet normal w_h from D(w_h) cos theta_h, and
+        // reflect w_o about it. PBRT 2nd ed. p.697
+        //   cos theta_h = u^(1/(e+1)),  phi_h = 2 pi v
+        float cos_h = powf(uv[0], 1 / (exponent + 1));
+        float sin_h = sqrtf(std::max(0.0f, 1 - cos_h*cos_h));
+        float phi = uv[1] * M_2PI;
+        vec3 wh(sin_h * cos(phi), sin_h * sin(phi), cos_h);
+        if (wo.z < 0) wh = -wh;
+
+        *wi = -wo + 2 * dot(wo, wh) * wh;
+        *pdf = pdf_half(wo, wh);
+        return f(wo, *wi);
+    }
+
+    virtual Spectrum f (const vec3& wo, const vec3& wi) const
+    {
+        if (wi.z <= 0) return Spectrum(0);
 
         // Half angle.
-        vec3 wh = normalize(*wi + wo);// * .5f;
+        vec3 wh = normalize(wi + wo);// * .5f;
 
         // Microfacet distribution.
-        float e = 140;
+        float e = exponent;
         float D = (e+2) / (2*M_PI) * powf(abs_cos_theta(wh), e);
 
-        float G = std::min(1.0f, 2*wh.z/dot(wo,wh) * std::min(wo.z, wi->z));
+        float G = std::min(1.0f, 2*wh.z/dot(wo,wh) * std::min(wo.z, wi.z));
         // placeholder
         float F = 1;//abs_cos_theta(wh); // ???
 
-        return rho * (D * G * F / (4  * abs_cos_theta(wo) * abs_cos_theta(*wi)));
+        return rho * (D * G * F / (4  * abs_cos_theta(wo) * abs_cos_theta(wi)));
 
     }
+
+    virtual float pdf (const vec3& wo, const vec3& wi) const
+    {
+        // Below the surface f is zero, and with wi = -wo there is no half
+        // vector to normalize.
+        if (wi.z <= 0) return 0;
+        vec3 h = wo + wi;
+        if (h == vec3(0.0f)) return 0;
+        return pdf_half(wo, normalize(h));
+    }
+
+private:
+    /// Density of sample picking the w_i that is w_o reflected about wh.
+    /// The density of w_h is turned into that of w_i by the Jacobian of
+    /// the reflection, 1 / (4 w_o . w_h).
+    float pdf_half (const vec3& wo, const vec3& wh) const
+    {
+        float wo_dot_wh = dot(wo, wh);
+        if (wo_dot_wh <= 0) return 0;
+        float pdf_h = (exponent + 1) / M_2PI * powf(abs_cos_theta(wh), exponent);
+        return pdf_h / (4 * wo_dot_wh);
+    }
 };
 
 
@@ -468,10 +542,10 @@ public:
     shared_ptr<Texture> R;
     Transform xform;
 
-    virtual unique_ptr<BSDF> get_bsdf (const vec3& p, const vec2& u) const
+    virtual BSDF* get_bsdf (const vec3& p, const vec2& u, MemoryArena& arena) const
     {
         Spectrum r = R->sample(vec2(0,0), xform.point(p));
-        return unique_ptr<BSDF>(new Lambertian(r));
+        return arena.create<Lambertian>(r);
     }
 
 };
@@ -487,11 +561,11 @@ public:
     shared_ptr<Texture> S;
     Transform xform;
 
-    virtual unique_ptr<BSDF> get_bsdf (const vec3& p, const vec2& u) const
+    virtual BSDF* get_bsdf (const vec3& p, const vec2& u, MemoryArena& arena) const
     {
         Spectrum r = R->sample(vec2(0,0), xform.point(p));
         Spectrum s = S->sample(vec2(0,0), xform.point(p));
-        return unique_ptr<BSDF>(new OrenNayar(r, s));
+        return arena.create<OrenNayar>(r, s);
     }
 
 };
@@ -505,9 +579,9 @@ public:
 
     Spectrum R;
 
-    virtual unique_ptr<BSDF> get_bsdf (const vec3& p, const vec2& u) const
+    virtual BSDF* get_bsdf (const vec3& p, const vec2& u, MemoryArena& arena) const
     {
-        return unique_ptr<BSDF>(new SpecularReflection(R, make_shared<FresnelOne>()));
+        return arena.create<SpecularReflection>(R, arena.create<FresnelOne>());
     }
 
 };
@@ -521,10 +595,10 @@ public:
 
     Spectrum R;
 
-    virtual unique_ptr<BSDF> get_bsdf (const vec3& p, const vec2& u) const
+    virtual BSDF* get_bsdf (const vec3& p, const vec2& u, MemoryArena& arena) const
     {
     //    return unique_ptr<BSDF>(new SpecularReflection(R, make_shared<FresnelOne>()));
-        return unique_ptr<BSDF>(new TorranceSparrow(R));
+        return arena.create<TorranceSparrow>(R);
     }
 
 };
@@ -538,11 +612,11 @@ public:
 
     Spectrum n, k;
 
-    virtual unique_ptr<BSDF> get_bsdf (const vec3& p, const vec2& u) const
+    virtual BSDF* get_bsdf (const vec3& p, const vec2& u, MemoryArena& arena) const
     {
         // return unique_ptr<BSDF>(new SpecularReflection(R, make_shared<FresnelConductor>(0.05f, 3.131f)));
         // 650, 
-        return unique_ptr<BSDF>(new SpecularReflection(Spectrum(1), make_shared<FresnelConductor>(n,k)));
+        return arena.create<SpecularReflection>(Spectrum(1), arena.create<FresnelConductor>(n,k));
                                 // Spectrum(0.21845, 1.16576, 1.031265), Spectrum(3.6370, 3.0957, 2.3896))));
                                 // Spectrum(0.2378, 1.0066269, 1.31346), Spectrum(3.6264, 2.5823, 2.1309))));
         // return unique_ptr<BSDF>(new SpecularReflection(R, make_shared<FresnelDielectric>(1.0f, 1.5f)));
@@ -560,7 +634,7 @@ public:
 
     Spectrum R;
 
-    virtual unique_ptr<BSDF> get_bsdf (const vec3& p, const vec2& u) const
+    virtual BSDF* get_bsdf (const vec3& p, const vec2& u, MemoryArena& arena) const
     {
         // These should be scaled by 2, because p == 1/2.
         // But we can't scale a BSDF.
@@ -568,10 +642,10 @@ public:
         // Well, I guess we can scale the R.
         // if (frand() < 0.5f) {
         if (u.x < 0.5f) {
-            return unique_ptr<BSDF>(new SpecularReflection(2.0f*R, make_shared<FresnelDielectric>(1.0f, 1.3f)));
+            return arena.create<SpecularReflection>(2.0f*R, arena.create<FresnelDielectric>(1.0f, 1.3f));
         }
         else {
-            return unique_ptr<BSDF>(new SpecularTransmission(2.0f*R, make_shared<FresnelDielectric>(1.0f, 1.3f)));
+            return arena.create<SpecularTransmission>(2.0f*R, arena.create<FresnelDielectric>(1.0f, 1.3f));
         }
 
         // return unique_ptr<BSDF>(new SpecularTransmission(R, make_shared<FresnelDielectric>(1.0f, 1.3f)));
@@ -588,9 +662,9 @@ public:
 
     Spectrum R;
 
-    virtual unique_ptr<BSDF> get_bsdf (const vec3& p, const vec2& u) const
+    virtual BSDF* get_bsdf (const vec3& p, const vec2& u, MemoryArena& arena) const
     {
-        return unique_ptr<BSDF>(new SpecularTransmission(R, make_shared<FresnelDielectric>(1.0f, 1.3f)));
+        return arena.create<SpecularTransmission>(R, arena.create<FresnelDielectric>(1.0f, 1.3f));
     }
 
 };
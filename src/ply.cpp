@@ -0,0 +1,382 @@
+#include "ply.hpp"
+#include "mappedfile.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+enum class Format { ascii, binary_le, binary_be };
+
+enum class Type { int8, uint8, int16, uint16, int32, uint32, float32, float64 };
+
+struct Property
+{
+    std::string name;
+    Type type;
+    /// Lists have a count of type count_type followed by that many
+    /// items of #type.
+    bool is_list;
+    Type count_type;
+};
+
+struct Element
+{
+    std::string name;
+    size_t count;
+    std::vector<Property> props;
+
+    /// @return index of the property called #name, or -1
+    int find (const std::string& name) const
+    {
+        for (size_t i = 0; i < props.size(); i++) {
+            if (props[i].name == name) return i;
+        }
+        return -1;
+    }
+
+    bool has_lists () const
+    {
+        for (auto& p : props) {
+            if (p.is_list) return true;
+        }
+        return false;
+    }
+};
+
+int type_size (Type t)
+{
+    switch (t) {
+    case Type::int8:
+    case Type::uint8:   return 1;
+    case Type::int16:
+    case Type::uint16:  return 2;
+    case Type::int32:
+    case Type::uint32:
+    case Type::float32: return 4;
+    case Type::float64: return 8;
+    }
+    return 0;
+}
+
+Type parse_type (const std::string& s)
+{
+    if (s == "char"   || s == "int8")    return Type::int8;
+    if (s == "uchar"  || s == "uint8")   return Type::uint8;
+    if (s == "short"  || s == "int16")   return Type::int16;
+    if (s == "ushort" || s == "uint16")  return Type::uint16;
+    if (s == "int"    || s == "int32")   return Type::int32;
+    if (s == "uint"   || s == "uint32")  return Type::uint32;
+    if (s == "float"  || s == "float32") return Type::float32;
+    if (s == "double" || s == "float64") return Type::float64;
+    throw std::runtime_error("ply: unknown property type " + s);
+}
+
+bool host_is_little_endian ()
+{
+    uint16_t x = 1;
+    char c;
+    std::memcpy(&c, &x, 1);
+    return c == 1;
+}
+
+template <typename T>
+T load (const char* p, bool swap)
+{
+    T v;
+    if (swap) {
+        char b[sizeof(T)];
+        for (size_t i = 0; i < sizeof(T); i++) b[i] = p[sizeof(T)-1-i];
+        std::memcpy(&v, b, sizeof(T));
+    }
+    else {
+        std::memcpy(&v, p, sizeof(T));
+    }
+    return v;
+}
+
+/// Converts the binary value of type #t at #p.
+double load_value (const char* p, Type t, bool swap)
+{
+    switch (t) {
+    case Type::int8:    return load<int8_t>(p, swap);
+    case Type::uint8:   return load<uint8_t>(p, swap);
+    case Type::int16:   return load<int16_t>(p, swap);
+    case Type::uint16:  return load<uint16_t>(p, swap);
+    case Type::int32:   return load<int32_t>(p, swap);
+    case Type::uint32:  return load<uint32_t>(p, swap);
+    case Type::float32: return load<float>(p, swap);
+    case Type::float64: return load<double>(p, swap);
+    }
+    return 0;
+}
+
+/// Reads the values of the body one at a time, in either format.
+class Reader
+{
+public:
+    Reader (const char* begin, const char* end, Format format)
+        : p(begin), end(end), format(format),
+          swap((format == Format::binary_le) != host_is_little_endian())
+    { }
+
+    double read (Type t)
+    {
+        if (format != Format::ascii) {
+            const char* v = take(type_size(t));
+            return load_value(v, t, swap);
+        }
+        while (p < end && is_space(*p)) p++;
+        const char* tok = p;
+        while (p < end && !is_space(*p)) p++;
+        size_t n = p - tok;
+        if (n == 0) throw std::runtime_error("ply: unexpected end of file");
+        // The mapping is not null-terminated, so strtod gets a copy.
+        char buf[64];
+        if (n >= sizeof(buf)) throw std::runtime_error("ply: bad number");
+        std::memcpy(buf, tok, n);
+        buf[n] = 0;
+        char* tail;
+        double v = std::strtod(buf, &tail);
+        if (tail != buf + n) throw std::runtime_error("ply: bad number " + std::string(buf));
+        return v;
+    }
+
+    /// Skips one record of #e.
+    void skip (const Element& e)
+    {
+        for (auto& prop : e.props) {
+            size_t n = prop.is_list ? (size_t)read(prop.count_type) : 1;
+            for (size_t i = 0; i < n; i++) read(prop.type);
+        }
+    }
+
+    /// @return pointer to the next #n bytes of a binary body
+    const char* take (size_t n)
+    {
+        if ((size_t)(end - p) < n) throw std::runtime_error("ply: unexpected end of file");
+        const char* v = p;
+        p += n;
+        return v;
+    }
+
+    bool is_binary () const { return format != Format::ascii; }
+    bool needs_swap () const { return swap; }
+
+private:
+    const char* p;
+    const char* end;
+    Format format;
+    bool swap;
+
+    static bool is_space (char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+};
+
+/// Index of the first of the given properties that #e has, or -1.
+int find_any (const Element& e, std::initializer_list<const char*> names)
+{
+    for (auto* name : names) {
+        int i = e.find(name);
+        if (i >= 0) return i;
+    }
+    return -1;
+}
+
+void read_vertices (Reader& in, const Element& e, PlyMesh* mesh)
+{
+    int xyz[3] = { e.find("x"), e.find("y"), e.find("z") };
+    if (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0) {
+        throw std::runtime_error("ply: vertex element without x, y and z");
+    }
+    int nxyz[3] = { e.find("nx"), e.find("ny"), e.find("nz") };
+    bool has_normals = nxyz[0] >= 0 && nxyz[1] >= 0 && nxyz[2] >= 0;
+
+    size_t n = e.count;
+    mesh->vertices.resize(n);
+    if (has_normals) mesh->normals.resize(n);
+
+    if (in.is_binary() && !e.has_lists()) {
+        // Fixed-size records: the properties are converted straight out
+        // of the mapping.
+        std::vector<size_t> offset(e.props.size());
+        size_t stride = 0;
+        for (size_t i = 0; i < e.props.size(); i++) {
+            offset[i] = stride;
+            stride += type_size(e.props[i].type);
+        }
+        const char* base = in.take(n * stride);
+        bool swap = in.needs_swap();
+
+        static_assert(sizeof(vec3) == 3*sizeof(float), "vec3 should be three packed floats");
+        bool packed_xyz = !swap && stride == sizeof(vec3) &&
+            xyz[0] == 0 && xyz[1] == 1 && xyz[2] == 2 &&
+            e.props[0].type == Type::float32 &&
+            e.props[1].type == Type::float32 &&
+            e.props[2].type == Type::float32;
+        if (packed_xyz) {
+            if (n > 0) std::memcpy(&mesh->vertices[0], base, n * stride);
+            return;
+        }
+
+        auto get = [&](const char* rec, int prop) {
+            return (float)load_value(rec + offset[prop], e.props[prop].type, swap);
+        };
+        for (size_t i = 0; i < n; i++) {
+            const char* rec = base + i * stride;
+            mesh->vertices[i] = vec3(get(rec, xyz[0]), get(rec, xyz[1]), get(rec, xyz[2]));
+            if (has_normals) {
+                mesh->normals[i] = vec3(get(rec, nxyz[0]), get(rec, nxyz[1]), get(rec, nxyz[2]));
+            }
+        }
+        return;
+    }
+
+    std::vector<float> values(e.props.size());
+    for (size_t i = 0; i < n; i++) {
+        for (size_t k = 0; k < e.props.size(); k++) {
+            const Property& prop = e.props[k];
+            if (prop.is_list) {
+                size_t len = in.read(prop.count_type);
+                for (size_t j = 0; j < len; j++) in.read(prop.type);
+            }
+            else {
+                values[k] = in.read(prop.type);
+            }
+        }
+        mesh->vertices[i] = vec3(values[xyz[0]], values[xyz[1]], values[xyz[2]]);
+        if (has_normals) {
+            mesh->normals[i] = vec3(values[nxyz[0]], values[nxyz[1]], values[nxyz[2]]);
+        }
+    }
+}
+
+void read_faces (Reader& in, const Element& e, PlyMesh* mesh)
+{
+    int list = find_any(e, {"vertex_indices", "vertex_index"});
+    if (list < 0 || !e.props[list].is_list) {
+        throw std::runtime_error("ply: face element without vertex_indices");
+    }
+    const Property& index_prop = e.props[list];
+    // Triangles can be copied whole when they are the only property.
+    bool copy_triangles = in.is_binary() && !in.needs_swap() && e.props.size() == 1 &&
+        (index_prop.type == Type::int32 || index_prop.type == Type::uint32);
+
+    mesh->indices.reserve(mesh->indices.size() + e.count * 3);
+    std::vector<int> poly;
+    for (size_t i = 0; i < e.count; i++) {
+        poly.clear();
+        for (size_t k = 0; k < e.props.size(); k++) {
+            const Property& prop = e.props[k];
+            if ((int)k != list) {
+                size_t len = prop.is_list ? (size_t)in.read(prop.count_type) : 1;
+                for (size_t j = 0; j < len; j++) in.read(prop.type);
+                continue;
+            }
+            size_t len = in.read(prop.count_type);
+            if (copy_triangles && len == 3) {
+                int tri[3];
+                std::memcpy(tri, in.take(sizeof(tri)), sizeof(tri));
+                poly.assign(tri, tri + 3);
+            }
+            else {
+                for (size_t j = 0; j < len; j++) poly.push_back(in.read(prop.type));
+            }
+        }
+        // Split into a fan around the first vertex.
+        for (size_t j = 1; j + 1 < poly.size(); j++) {
+            mesh->indices.push_back(poly[0]);
+            mesh->indices.push_back(poly[j]);
+            mesh->indices.push_back(poly[j+1]);
+        }
+    }
+}
+
+} // namespace
+
+void read_ply (const std::string& filename, PlyMesh* mesh)
+{
+    MappedFile file(filename);
+    const char* data = file.data();
+    const char* end = data + file.size();
+
+    // The header is short, and plain text.
+    const char* marker = "end_header";
+    const char* body = nullptr;
+    for (const char* p = data; p + strlen(marker) <= end; p++) {
+        if (std::memcmp(p, marker, strlen(marker)) == 0) {
+            body = p + strlen(marker);
+            while (body < end && *body != '\n') body++;
+            if (body < end) body++;
+            break;
+        }
+    }
+    if (!body) throw std::runtime_error("ply: no end_header in " + filename);
+    std::istringstream header(std::string(data, body));
+
+    std::string line;
+    std::getline(header, line);
+    if (line != "ply" && line != "ply\r") throw std::runtime_error("ply: bad magic");
+
+    Format format = Format::ascii;
+    bool has_format = false;
+    std::vector<Element> elements;
+    while (std::getline(header, line)) {
+        std::istringstream words(line);
+        std::string tok;
+        words >> tok;
+        if (tok == "format") {
+            words >> tok;
+            if (tok == "ascii") format = Format::ascii;
+            else if (tok == "binary_little_endian") format = Format::binary_le;
+            else if (tok == "binary_big_endian") format = Format::binary_be;
+            else throw std::runtime_error("ply: bad format " + tok);
+            has_format = true;
+        }
+        else if (tok == "element") {
+            Element e;
+            if (!(words >> e.name >> e.count)) throw std::runtime_error("ply: bad element: " + line);
+            elements.push_back(e);
+        }
+        else if (tok == "property") {
+            if (elements.empty()) throw std::runtime_error("ply: property outside element");
+            Property prop;
+            words >> tok;
+            prop.is_list = (tok == "list");
+            if (prop.is_list) {
+                words >> tok;
+                prop.count_type = parse_type(tok);
+                words >> tok;
+            }
+            prop.type = parse_type(tok);
+            if (!(words >> prop.name)) throw std::runtime_error("ply: bad property: " + line);
+            elements.back().props.push_back(prop);
+        }
+    }
+    if (!has_format) throw std::runtime_error("ply: no format line");
+
+    Reader in(body, end, format);
+    for (auto& e : elements) {
+        if (e.name == "vertex") read_vertices(in, e, mesh);
+        else if (e.name == "face") read_faces(in, e, mesh);
+        else if (in.is_binary() && !e.has_lists()) {
+            size_t size = 0;
+            for (auto& prop : e.props) size += type_size(prop.type);
+            in.take(e.count * size);
+        }
+        else {
+            for (size_t i = 0; i < e.count; i++) in.skip(e);
+        }
+    }
+
+    for (int i : mesh->indices) {
+        if (i < 0 || (size_t)i >= mesh->vertices.size()) {
+            throw std::runtime_error("ply: vertex index out of range in " + filename);
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef _PLY_HPP_
+#define _PLY_HPP_
+
+#include "mymath.hpp"
+#include <string>
+#include <vector>
+
+/// The parts of a PLY file that a mesh is made of.
+struct PlyMesh
+{
+    std::vector<vec3> vertices;
+    /// Per-vertex normals, empty if the file has none.
+    std::vector<vec3> normals;
+    /// Three vertex indices per triangle. Polygons are split into fans.
+    std::vector<int> indices;
+};
+
+/// Reads an ascii, binary_little_endian or binary_big_endian PLY file.
+/// The file is memory-mapped, and binary vertex and face arrays are
+/// copied or converted straight out of the mapping. Properties and
+/// elements other than those of PlyMesh are skipped.
+/// Throws std::runtime_error if the file is malformed.
+void read_ply (const std::string& filename, PlyMesh* mesh);
+
+#endif // _PLY_HPP_
@@ -0,0 +1,62 @@
+#include "preview.hpp"
+
+PreviewWriter::PreviewWriter (const Film& film, const std::string& basename,
+                              bool png, const ToneMap& tm)
+    : film(film), tiles(film), snapshot(film), basename(basename), png(png), tm(tm),
+      pending(false), stop(false), count(0)
+{
+    thread = std::thread(&PreviewWriter::run, this);
+}
+
+PreviewWriter::~PreviewWriter ()
+{
+    finish();
+}
+
+void PreviewWriter::tile_finished (int x0, int y0, int w, int h)
+{
+    std::lock_guard<std::mutex> lck(tiles_mtx);
+    tiles.copy_tile(film, x0, y0, w, h);
+    dirty.push_back(Rect{ x0, y0, w, h });
+}
+
+void PreviewWriter::request ()
+{
+    {
+        std::lock_guard<std::mutex> lck(mtx);
+        pending = true;
+    }
+    cv.notify_one();
+}
+
+void PreviewWriter::finish ()
+{
+    {
+        std::lock_guard<std::mutex> lck(mtx);
+        stop = true;
+    }
+    cv.notify_one();
+    if (thread.joinable()) thread.join();
+}
+
+void PreviewWriter::run ()
+{
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lck(mtx);
+            cv.wait(lck, [this]() { return pending || stop; });
+            if (stop) return;
+            pending = false;
+        }
+        {
+            std::lock_guard<std::mutex> lck(tiles_mtx);
+            for (const Rect& r : dirty) {
+                snapshot.copy_tile(tiles, r.x0, r.y0, r.w, r.h);
+            }
+            dirty.clear();
+        }
+        snapshot.save_rgbe((basename + ".hdr").c_str());
+        if (png) snapshot.save((basename + ".png").c_str(), tm);
+        count++;
+    }
+}
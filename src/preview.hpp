@@ -0,0 +1,71 @@
+#ifndef _PREVIEW_HPP_
+#define _PREVIEW_HPP_
+
+#include "film.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Writes preview images of a film while it is being rendered, on a
+/// thread of its own. The film is never read while a render thread may
+/// be writing the same pixels: the render threads copy each tile they
+/// finish into a front buffer, and the writer copies that into a snapshot
+/// of its own, which it encodes and writes, so a slow disk never holds
+/// up the render. The previews show the tiles as of their last finish.
+class PreviewWriter
+{
+public:
+    /// Previews go to <basename>.hdr, and to a tone mapped <basename>.png
+    /// if #png is set.
+    PreviewWriter (const Film& film, const std::string& basename,
+                   bool png = false, const ToneMap& tm = ToneMap());
+    ~PreviewWriter ();
+
+    PreviewWriter (const PreviewWriter&) = delete;
+    PreviewWriter& operator= (const PreviewWriter&) = delete;
+
+    /// Copies a tile that has just been rendered for the next preview.
+    /// Called by the thread that rendered it, one tile at a time.
+    void tile_finished (int x0, int y0, int w, int h);
+    /// Asks for a preview. Returns at once; requests made while a
+    /// preview is being written are served by one more preview after it.
+    void request ();
+    /// Waits for the preview being written, if any, and stops the
+    /// writer. Pending requests are dropped.
+    void finish ();
+
+    int written () const { return count; }
+
+private:
+    const Film& film;
+    /// The finished tiles, updated by the render threads.
+    Film tiles;
+    struct Rect { int x0, y0, w, h; };
+    /// Tiles finished since the last preview.
+    std::vector<Rect> dirty;
+    /// Guards tiles and dirty.
+    std::mutex tiles_mtx;
+    /// Copy of tiles that the writer writes out. Only the dirty tiles are
+    /// copied, so that the render threads are not held up by a copy of
+    /// the whole film.
+    Film snapshot;
+    std::string basename;
+    bool png;
+    ToneMap tm;
+
+    /// Guards pending and stop. Never held while a preview is written.
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool pending;
+    bool stop;
+    std::thread thread;
+
+    std::atomic<int> count;
+
+    void run ();
+};
+
+#endif // _PREVIEW_HPP_
@@ -1,35 +1,210 @@
 #include "random.hpp"
 #include "util.hpp"
+#include <cstdint>
 #include <exception>
 
+/// Low discrepancy sequences and their scrambling.
+/// Owen scrambling after B. Burley, Practical Hash-based Owen Scrambling,
+/// JCGT 2020.
+namespace lds {
+
+const float one_minus_epsilon = 0.99999994f;
+
+inline
+uint32_t hash (uint32_t x)
+{
+    // lowbias32 by C. Wellons.
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline
+uint32_t hash_combine (uint32_t seed, uint32_t v)
+{
+    return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+inline
+uint32_t reverse_bits (uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/// Flips each bit depending only on the bits below it. On a bit-reversed
+/// number that is a nested uniform scramble of the digits.
+inline
+uint32_t laine_karras_permutation (uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+/// Owen scrambling of a 32-bit fixed point number in [0,1).
+inline
+uint32_t owen_scramble (uint32_t x, uint32_t seed)
+{
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+/// Second dimension of the Sobol sequence, looked up a byte of the index
+/// at a time. Its direction numbers follow from the primitive polynomial
+/// x + 1; the first dimension is the bit-reversed index.
+struct SobolDim1
+{
+    uint32_t table[4][256];
+
+    SobolDim1 ()
+    {
+        uint32_t v[32];
+        v[0] = 1u << 31;
+        for (int k = 1; k < 32; k++) v[k] = v[k-1] ^ (v[k-1] >> 1);
+        for (int byte = 0; byte < 4; byte++) {
+            for (int b = 0; b < 256; b++) {
+                uint32_t r = 0;
+                for (int k = 0; k < 8; k++) {
+                    if (b & (1 << k)) r ^= v[byte*8 + k];
+                }
+                table[byte][b] = r;
+            }
+        }
+    }
+
+    uint32_t operator() (uint32_t index) const
+    {
+        return table[0][index & 0xff] ^ table[1][(index >> 8) & 0xff] ^
+               table[2][(index >> 16) & 0xff] ^ table[3][index >> 24];
+    }
+};
+const SobolDim1 sobol_dim1;
+
+inline
+float to_float (uint32_t x)
+{
+    return std::min(x * 2.3283064e-10f, one_minus_epsilon);
+}
+
+/// Element #i of a random permutation of 0..l-1 picked by #p.
+/// A. Kensler, Correlated Multi-Jittered Sampling, 2013.
+inline
+uint32_t permutation_element (uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893du;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3fu;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+const int prime_count = 40;
+const int primes[prime_count] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71,
+    73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131, 137, 139, 149, 151,
+    157, 163, 167, 173
+};
+
+/// Owen-scrambled radical inverse of #index in #base: every digit goes
+/// through a random permutation hashed from #seed and the digits before
+/// it.
+inline
+float scrambled_radical_inverse (uint32_t index, int base, uint32_t seed)
+{
+    float inv_base = 1.0f / base;
+    float inv_base_n = 1;
+    uint32_t prefix = seed;
+    float r = 0;
+    while (index > 0) {
+        uint32_t next = index / base;
+        uint32_t digit = index - next * base;
+        digit = permutation_element(digit, base, hash(prefix));
+        prefix = hash_combine(prefix, digit);
+        inv_base_n *= inv_base;
+        r += digit * inv_base_n;
+        index = next;
+    }
+    // The rest of the digits are scrambled zeros. Each is uniform and
+    // independent of the others, and fixed by the prefix, so together
+    // they are a uniform number hashed from the prefix.
+    r += to_float(hash(prefix)) * inv_base_n;
+    return std::min(r, one_minus_epsilon);
+}
+
+} // namespace lds
+
+
 SampleGenerator::SampleGenerator (int n2d, int samples_per_pixel)
     : spp(samples_per_pixel),
+    n2d(n2d),
+    rng(nullptr),
     samples(samples_per_pixel),
-    n2d(n2d) 
+    storage(n2d * samples_per_pixel)
 { }
 
+void SampleGenerator::generate (Pcg32* rng, unsigned int seed, int first)
+{
+    this->rng = rng;
+    fill(seed, first);
+    for (int i = 0; i < spp; i++) {
+        Sample& s = samples[i];
+        s.samples_2d = n2d > 0 ? &at(i, 0) : nullptr;
+        s.n2d = n2d;
+        s.index_2d = 0;
+        s.rng = rng;
+    }
+}
+
 
 SampleGeneratorRandom::SampleGeneratorRandom (int n2d, int samples_per_pixel)
     : SampleGenerator(n2d, samples_per_pixel)
 { }
 
-void SampleGeneratorRandom::generate (std::mt19937* rng)
+void SampleGeneratorRandom::fill (unsigned int seed, int first)
 {
-    this->rng = rng;
-    distribution = std::uniform_real_distribution<float>(0,1);
-
     for (int i = 0; i < spp; i++) {
-        samples[i] = Sample(rng, n2d);
-
         for (unsigned int j = 0; j < n2d; j++) {
-            samples[i].samples_2d[j] = rand2f();
+            float u = rng->uniform();
+            at(i, j) = vec2(u, rng->uniform());
         }
     }
 }
 
 
 SampleGeneratorStratified::SampleGeneratorStratified (int n2d, int samples_per_pixel)
-    : SampleGenerator(n2d, samples_per_pixel)
+    : SampleGenerator(n2d, samples_per_pixel),
+    indices(samples_per_pixel)
 {
     dim = (int)sqrtf(spp);
     if (spp != dim*dim) {
@@ -37,46 +212,73 @@ SampleGeneratorStratified::SampleGeneratorStratified (int n2d, int samples_per_p
     }
 }
 
-void SampleGeneratorStratified::generate (std::mt19937* rng)
+void SampleGeneratorStratified::fill (unsigned int seed, int first)
 {
-    this->rng = rng;
-    distribution = std::uniform_real_distribution<float>(0,1);
-
     for (int i = 0; i < spp; i++) {
-        samples[i] = Sample(rng, n2d);
-    }
-
-    std::vector<int> indices(spp);
-    for (unsigned int i = 0; i < spp; i++) {
         indices[i] = i;
     }
-    double dimrcp = 1.0 / dim;
+    float dimrcp = 1.0f / dim;
     for (unsigned int j = 0; j < n2d; j++) {
-        std::shuffle(indices.begin(), indices.end(), *rng);
+        // Fisher-Yates shuffle.
+        for (int i = spp - 1; i > 0; i--) {
+            std::swap(indices[i], indices[rng->uniform(i + 1)]);
+        }
         for (int v = 0; v < dim; v++) {
             for (int u = 0; u < dim; u++) {
                 int i = u + v*dim;
-                float uf = std::uniform_real_distribution<float>(u*dimrcp, (u+1)*dimrcp)(*rng);
-                float vf = std::uniform_real_distribution<float>(v*dimrcp, (v+1)*dimrcp)(*rng);
-                // float uf = std::uniform_real_distribution<float>(0, 1)(*rng);
-                // float vf = std::uniform_real_distribution<float>(0, 1)(*rng);
-                samples[indices[i]].samples_2d[j] = vec2(uf, vf);
+                float uf = (u + rng->uniform()) * dimrcp;
+                float vf = (v + rng->uniform()) * dimrcp;
+                // Rounding may land on the upper edge of the last stratum.
+                at(indices[i], j) = vec2(std::min(uf, lds::one_minus_epsilon),
+                                         std::min(vf, lds::one_minus_epsilon));
             }
         }
     }
 }
 
 
-Sample::Sample ()
-    : samples_2d(0),
-    index_2d(0),
-    rng(nullptr)
+SampleGeneratorSobol::SampleGeneratorSobol (int n2d, int samples_per_pixel)
+    : SampleGenerator(n2d, samples_per_pixel)
 { }
 
-Sample::Sample (std::mt19937* rng, int n2d)
-    : samples_2d(n2d),
-    index_2d(0),
-    rng(rng),
-    distribution(0,1)
-{ }
+void SampleGeneratorSobol::fill (unsigned int seed, int first)
+{
+    for (unsigned int j = 0; j < n2d; j++) {
+        uint32_t dim_seed = lds::hash(lds::hash_combine(seed, j));
+        uint32_t seed_x = lds::hash(lds::hash_combine(dim_seed, 1));
+        uint32_t seed_y = lds::hash(lds::hash_combine(dim_seed, 2));
+        for (int i = 0; i < spp; i++) {
+            // Shuffle the sequence by Owen scrambling the index.
+            uint32_t index = lds::owen_scramble(first + i, dim_seed);
+            // owen_scramble(reverse_bits(index)), with the two reversals
+            // of the first dimension cancelled.
+            uint32_t x = lds::reverse_bits(lds::laine_karras_permutation(index, seed_x));
+            uint32_t y = lds::owen_scramble(lds::sobol_dim1(index), seed_y);
+            at(i, j) = vec2(lds::to_float(x), lds::to_float(y));
+        }
+    }
+}
+
+
+SampleGeneratorHalton::SampleGeneratorHalton (int n2d, int samples_per_pixel)
+    : SampleGenerator(n2d, samples_per_pixel)
+{
+    if (2 * n2d > lds::prime_count) {
+        throw std::range_error("Halton sampler has too few primes for n2d.");
+    }
+}
+
+void SampleGeneratorHalton::fill (unsigned int seed, int first)
+{
+    for (unsigned int j = 0; j < n2d; j++) {
+        int base_x = lds::primes[2*j];
+        int base_y = lds::primes[2*j + 1];
+        uint32_t seed_x = lds::hash(lds::hash_combine(seed, 2*j));
+        uint32_t seed_y = lds::hash(lds::hash_combine(seed, 2*j + 1));
+        for (int i = 0; i < spp; i++) {
+            at(i, j) = vec2(lds::scrambled_radical_inverse(first + i, base_x, seed_x),
+                            lds::scrambled_radical_inverse(first + i, base_y, seed_y));
+        }
+    }
+}
 
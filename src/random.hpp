@@ -1,10 +1,114 @@
 #include <random>
+#include <cstdint>
 #include "mymath.hpp"
 #include "util.hpp"
 
 class Sample;
 
+/// Stateless 64-bit mixing function (the splitmix64 finalizer), for
+/// deriving seeds from counters.
+inline
+uint64_t mix_bits (uint64_t v)
+{
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= v >> 33;
+    return v;
+}
+
+
+/// PCG32 random number generator (M. O'Neill, pcg-random.org).
+/// 16 bytes of state, so it is cheap to seed for every pixel.
+class Pcg32
+{
+public:
+    Pcg32 (uint64_t seed = 0, uint64_t stream = 0)
+    {
+        this->seed(seed, stream);
+    }
+
+    /// Generators with different streams give different sequences for
+    /// the same seed.
+    void seed (uint64_t seed, uint64_t stream = 0)
+    {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next();
+        state += seed;
+        next();
+    }
+
+    uint32_t next ()
+    {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+        uint32_t rot = old >> 59;
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    /// @return uniform float in [0,1)
+    float uniform ()
+    {
+        // The top 24 bits fill the mantissa exactly.
+        return (next() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    /// @return uniform integer in [0,bound)
+    uint32_t uniform (uint32_t bound)
+    {
+        // Reject the values that would make the modulo biased.
+        uint32_t threshold = (-bound) % bound;
+        while (true) {
+            uint32_t r = next();
+            if (r >= threshold) return r % bound;
+        }
+    }
+
+private:
+    uint64_t state;
+    uint64_t inc;
+};
+
+
+/// One sample set of a pixel: n2d 2D samples, followed by as many more
+/// random ones as are asked for. A view into the storage of its
+/// SampleGenerator, valid until the next generate.
+class Sample
+{
+public:
+    Sample ()
+        : samples_2d(nullptr), n2d(0), index_2d(0), rng(nullptr)
+    { }
 
+    vec2 get2d ()
+    {
+        if (index_2d < n2d) {
+            return samples_2d[index_2d++];
+        }
+        return rand2f();
+    }
+
+    float randf () { return rng->uniform(); }
+    vec2 rand2f ()
+    {
+        float u = rng->uniform();
+        return vec2(u, rng->uniform());
+    }
+
+private:
+    friend class SampleGenerator;
+    const vec2* samples_2d;
+    unsigned int n2d;
+    unsigned int index_2d;
+    Pcg32* rng;
+};
+
+
+/// Makes the sample sets of one pixel at a time. All memory is allocated
+/// up front, and reused from pixel to pixel.
 class SampleGenerator
 {
 public:
@@ -13,63 +117,80 @@ public:
     ///             are accessed, the rest will be totally random.
     /// @par samples_per_pixel  Number of sample sets to generate.
     SampleGenerator (int n2d, int samples_per_pixel);
+    virtual ~SampleGenerator () {}
+
+    SampleGenerator (const SampleGenerator&) = delete;
+    SampleGenerator& operator= (const SampleGenerator&) = delete;
 
     /// Generates sample sets for a new pixel.
-    virtual void generate(std::mt19937* rng) = 0;
+    /// @par rng    Generator seeded for the pixel. Gives the samples of the
+    ///             random samplers, and those beyond n2d for all samplers.
+    /// @par seed   Seed of the pixel that stays the same from pass to pass.
+    ///             Scrambles the low discrepancy sequences.
+    /// @par first  Index of the first sample set in the pixel's sequence.
+    ///             Low discrepancy samplers give sample sets first, first+1,
+    ///             ... so that successive passes continue the sequence.
+    void generate (Pcg32* rng, unsigned int seed, int first);
 
     Sample& get (int index) { return samples[index]; }
 
-    float randf () { return distribution(*rng); }
-    vec2 rand2f () { return vec2(distribution(*rng), distribution(*rng)); }
-
 protected:
     int spp;
-    std::vector<Sample> samples;
     unsigned int n2d;
-    std::mt19937* rng;
-    std::uniform_real_distribution<float> distribution;
+    Pcg32* rng;
+
+    /// 2D sample #j of sample set #i.
+    vec2& at (int i, int j) { return storage[i*n2d + j]; }
+
+    /// Fills in the 2D samples of all the sample sets.
+    virtual void fill (unsigned int seed, int first) = 0;
+
+private:
+    std::vector<Sample> samples;
+    /// The 2D samples of all the sample sets, set by set.
+    std::vector<vec2> storage;
 };
 
 class SampleGeneratorRandom : public SampleGenerator
 {
 public:
     SampleGeneratorRandom (int n2d, int samples_per_pixel);
-    void generate(std::mt19937* rng);
+protected:
+    void fill (unsigned int seed, int first);
 };
 
 class SampleGeneratorStratified : public SampleGenerator
 {
 public:
     SampleGeneratorStratified (int n2d, int samples_per_pixel);
-    void generate(std::mt19937* rng);
+protected:
+    void fill (unsigned int seed, int first);
 private:
     int dim;
+    /// Scratch space for shuffling the strata.
+    std::vector<int> indices;
 };
 
-
-class Sample
+/// Owen-scrambled Sobol points. Each 2D sample is a point of the first two
+/// Sobol dimensions, a (0,2)-sequence, so any power of two spp is well
+/// stratified. The sample index is shuffled differently for each 2D sample
+/// so that they are not correlated with each other.
+class SampleGeneratorSobol : public SampleGenerator
 {
 public:
-    Sample ();
-    Sample (std::mt19937* rng, int n2d);
-
-    vec2 get2d ()
-    {
-        if (index_2d < samples_2d.size()) {
-            return samples_2d[index_2d++];
-        }
-        return rand2f();
-    }
-
-    float randf () { return distribution(*rng); }
-    vec2 rand2f () { return vec2(distribution(*rng), distribution(*rng)); }
+    SampleGeneratorSobol (int n2d, int samples_per_pixel);
+protected:
+    void fill (unsigned int seed, int first);
+};
 
-private:
-    friend class SampleGeneratorRandom;
-    friend class SampleGeneratorStratified;
-    std::vector<vec2> samples_2d;
-    unsigned int index_2d;
-    std::mt19937* rng;
-    std::uniform_real_distribution<float> distribution;
+/// Scrambled Halton points, with the 2D samples taking the dimensions of
+/// the sequence two at a time.
+class SampleGeneratorHalton : public SampleGenerator
+{
+public:
+    /// n2d is limited by the size of the prime table.
+    SampleGeneratorHalton (int n2d, int samples_per_pixel);
+protected:
+    void fill (unsigned int seed, int first);
 };
 
@@ -2,53 +2,41 @@
 #include "gray.hpp"
 #include "util.hpp"
 #include <iostream>
+#include <chrono>
 
 namespace threaded_render {
 
 Job::Job (int threads, const Scene& scene, Film& film)
-    : scene(scene), film(film)
+    : scene(scene), film(film), seed(14217), frame(0), next_worker(0), running(false),
+    callback_ns(0)
 {
-    // Initialize workers.
     for (int i = 0; i < threads; i++) {
-        workers.push_back(std::make_shared<Worker>(this));
-    }
-    seeds.resize(film.xres*film.xres);
-    std::default_random_engine generator;
-    generator.seed(14217);
-    for(unsigned int i = 0; i < seeds.size(); i++) {
-        seeds[i] = generator();
+        workers.emplace_back(new Worker(this));
     }
 }
 
 void Job::add_task (const TaskDesc& desc)
 {
-    // Get idle Worker.
-    std::unique_lock<std::mutex> lck(mtx);
-    Worker* w;
-    while ((w=find_worker(Worker::IDLE)) == nullptr) prod_cv.wait(lck);
-
-    // Assign work.
-    w->task = Task(this, desc);
-
-    // Start worker.
-    w->state = Worker::INPUT_READY;
-    lck.unlock();
-    w->cv.notify_all();
+    if (running) {
+        throw std::runtime_error("Tasks can't be added to a running job.");
+    }
+    // Deal the tasks out round-robin; stealing evens out the rest.
+    tasks.push_back(Task(this, desc));
+    workers[next_worker]->queue.push(tasks.size() - 1);
+    next_worker = (next_worker + 1) % workers.size();
 }
 
 void Job::finish ()
 {
-    wait_for_finish = true;
-
-    std::unique_lock<std::mutex> lck(mtx);
-    while (any_pending()) prod_cv.wait(lck);
-    lck.unlock();
-
+    running = true;
+    for (auto& w : workers) {
+        w->th = std::thread(&Worker::loop, w.get());
+    }
     for (auto& w : workers) {
-        w->state = Worker::QUIT;
-        w->cv.notify_all();
         w->th.join();
     }
+    tasks.clear();
+    running = false;
 }
 
 void Job::set_callback (std::function<void(const Task&)> cb)
@@ -57,26 +45,29 @@ void Job::set_callback (std::function<void(const Task&)> cb)
 }
 
 
-void Job::task_finished (const Task& task)
+void Job::task_finished (Task& task)
 {
-    film.merge(*task.film, task.xofs, task.yofs);
+    // The tiles don't overlap, so the merges can run side by side.
+    if (task.film) {
+        film.merge(*task.film, task.xofs, task.yofs);
+    }
     if (task_done_cb) {
+        auto t0 = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lck(cb_mtx);
         task_done_cb(task);
+        auto t1 = std::chrono::steady_clock::now();
+        callback_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
     }
+    task.film.reset();
 }
 
-Worker* Job::find_worker (int state)
-{
-    for (auto& w : workers) {
-        if (w->state == state) return w.get();
-    }
-    return nullptr;
-}
-
-bool Job::any_pending () const
+bool Job::steal (const Worker* thief, int* index)
 {
-    for (const auto& w : workers) {
-        if (w->state != Worker::IDLE) return true;
+    int n = workers.size();
+    int self = 0;
+    while (workers[self].get() != thief) self++;
+    for (int i = 1; i < n; i++) {
+        if (workers[(self + i) % n]->queue.steal(index)) return true;
     }
     return false;
 }
@@ -85,34 +76,90 @@ bool Job::any_pending () const
 
 Task::Task (Job* job, const TaskDesc& desc)
     : TaskDesc(desc),
-    job(job),
-    film(new Film(xres, yres))
+    job(job)
 { }
 
 
 
-void Task::render ()
+uint64_t Task::pixel_seed (int gx, int gy, int pass) const
 {
-    std::unique_ptr<SurfaceIntegrator> surf_integ(SurfaceIntegrator::make());
-    std::unique_ptr<SampleGenerator> sampler;
-    if (sampler_name == "random") {
-        sampler.reset(new SampleGeneratorRandom(20, spp));
+    uint64_t pixel = gx + (uint64_t)gy * job->film.xres;
+    uint64_t h = mix_bits(job->seed);
+    h = mix_bits(h ^ (uint64_t)job->frame);
+    h = mix_bits(h ^ (uint64_t)pass);
+    return mix_bits(h ^ pixel);
+}
+
+void Task::start_pixel (SampleGenerator* sampler, Pcg32* rng, int gx, int gy) const
+{
+    // Each pixel gets a stream of its own, so even colliding seeds give
+    // different sequences.
+    uint64_t pixel = gx + (uint64_t)gy * job->film.xres;
+    rng->seed(pixel_seed(gx, gy, pass), pixel);
+    // The low discrepancy samplers continue the pixel's sequence from
+    // pass to pass, so they get the seed of pass 0. The passes need not
+    // be of the same size, so the sequence continues from the samples
+    // rendered so far rather than from pass * spp.
+    sampler->generate(rng, (unsigned int)pixel_seed(gx, gy, 0), first_sample);
+}
+
+SampleGenerator* make_sampler (const std::string& name, int spp)
+{
+    if (name == "random") {
+        return new SampleGeneratorRandom(20, spp);
+    }
+    else if (name == "stratified") {
+        return new SampleGeneratorStratified(20, spp);
     }
-    else if (sampler_name == "stratified") {
-        sampler.reset(new SampleGeneratorStratified(20, spp));
+    else if (name == "sobol") {
+        return new SampleGeneratorSobol(20, spp);
+    }
+    else if (name == "halton") {
+        return new SampleGeneratorHalton(20, spp);
     }
     else {
         throw std::range_error("Bad sampler name.");
     }
-    std::mt19937 generator;
+}
+
+void Task::render (MemoryArena& arena)
+{
+    if (film_mode == "direct") {
+        tile = FilmTile(job->film, xofs, yofs, xres, yres, true);
+    }
+    else if (film_mode == "merge") {
+        // Allocate film here as a form of lazy initialization,
+        // in case we have lots of tasks just lying around.
+        film.reset(new Film(xres, yres));
+        tile = FilmTile(*film, 0, 0, xres, yres, false);
+    }
+    else {
+        throw std::range_error("Bad film mode.");
+    }
+
+    if (engine == "wavefront") {
+        render_wavefront(arena);
+        return;
+    }
+    else if (engine != "path") {
+        throw std::range_error("Bad engine name.");
+    }
+
+    std::unique_ptr<SurfaceIntegrator> surf_integ(SurfaceIntegrator::make(max_depth, rr_depth));
+    if (packet_size > 0) {
+        render_packets(surf_integ.get(), arena);
+        return;
+    }
+
+    std::unique_ptr<SampleGenerator> sampler(make_sampler(sampler_name, spp));
+    Pcg32 generator;
 
     Camera* cam = job->scene.camera.get();
     for (int ly = 0; ly < yres; ly++) {
         for (int lx = 0; lx < xres; lx++) {
             int gx = xofs + lx;
             int gy = yofs + ly;
-            generator.seed(job->seeds[gx+gy*job->film.xres]);
-            sampler->generate(&generator);
+            start_pixel(sampler.get(), &generator, gx, gy);
 
             for (int s = 0; s < spp; s++) {
                 Sample& sample = sampler->get(s);
@@ -129,39 +176,142 @@ void Task::render ()
                 Ray ray(cam->generate_ray(fgx, fgy, lens_sample.x,lens_sample.y));
 
                 debug::set(gx,gy,s);
-                Spectrum L = surf_integ->Li(ray, &job->scene, sample);
+                Spectrum L = surf_integ->Li(ray, &job->scene, sample, arena);
+                arena.reset();
                 debug::add("L", L);
-                film->add_sample(flx, fly, L);
+                tile.add_sample(flx, fly, L);
             }
         }
     }   
 }
 
+/// Traces the camera rays of packet_size x packet_size pixel blocks
+/// together, one sample index at a time. Every pixel keeps its own
+/// generator, so the pixels get the same samples as in render().
+void Task::render_packets (SurfaceIntegrator* surf_integ, MemoryArena& arena)
+{
+    int n = std::min<int>(packet_size, 8);
+    std::vector<std::unique_ptr<SampleGenerator>> samplers(n*n);
+    for (auto& s : samplers) {
+        s.reset(make_sampler(sampler_name, spp));
+    }
+    std::vector<Pcg32> generators(n*n);
+
+    RayPacket packet;
+    Isect isects[RayPacket::max_size];
+    bool hits[RayPacket::max_size];
+    vec2 offsets[RayPacket::max_size];
+
+    Camera* cam = job->scene.camera.get();
+    for (int by = 0; by < yres; by += n) {
+        for (int bx = 0; bx < xres; bx += n) {
+            int bw = std::min(n, xres - bx);
+            int bh = std::min(n, yres - by);
+
+            for (int i = 0; i < bw*bh; i++) {
+                int gx = xofs + bx + i % bw;
+                int gy = yofs + by + i / bw;
+                start_pixel(samplers[i].get(), &generators[i], gx, gy);
+            }
+
+            for (int s = 0; s < spp; s++) {
+                packet.clear();
+                for (int i = 0; i < bw*bh; i++) {
+                    int gx = xofs + bx + i % bw;
+                    int gy = yofs + by + i / bw;
+                    Sample& sample = samplers[i]->get(s);
+                    vec2 dxy = sample.get2d();
+                    offsets[i] = dxy;
+                    float fgx = (gx+dxy.x) / job->film.xres;
+                    float fgy = (gy+dxy.y) / job->film.yres;
+                    vec2 lens_sample = sample.get2d();
+                    packet.add(cam->generate_ray(fgx, fgy, lens_sample.x, lens_sample.y));
+                    hits[i] = false;
+                }
+                packet.update_bounds();
+                job->scene.intersect_packet(packet, isects, hits);
+
+                for (int i = 0; i < bw*bh; i++) {
+                    int lx = bx + i % bw;
+                    int ly = by + i / bw;
+                    Sample& sample = samplers[i]->get(s);
+
+                    debug::set(xofs+lx, yofs+ly, s);
+                    Spectrum L = surf_integ->Li(packet.rays[i], &job->scene, sample, arena,
+                                                hits[i], isects[i]);
+                    arena.reset();
+                    debug::add("L", L);
+                    tile.add_sample((lx+offsets[i].x) / xres, (ly+offsets[i].y) / yres, L);
+                }
+            }
+        }
+    }
+}
+
 
 ////
 
-Worker::Worker (Job* job)
-    : job(job), state(IDLE)
+void WorkDeque::push (int index)
 {
-    th = std::thread(&Worker::loop, this);
+    long b = bottom.load(std::memory_order_relaxed);
+    buffer.resize(b + 1);
+    buffer[b] = index;
+    bottom.store(b + 1, std::memory_order_release);
 }
 
-void Worker::loop ()
+bool WorkDeque::pop (int* index)
+{
+    long b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+        // Empty.
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+    *index = buffer[b];
+    if (t == b) {
+        // The last task; race the thieves for it.
+        bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                               std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+bool WorkDeque::steal (int* index)
 {
     while (true) {
-        std::unique_lock<std::mutex> lck(job->mtx);
-        while (state != INPUT_READY && state != QUIT) cv.wait(lck);
-        if (state == QUIT) return;
-        state = WORKING;
-        lck.unlock();
+        long t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return false;
+        int i = buffer[t];
+        if (top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+            *index = i;
+            return true;
+        }
+        // Lost to the owner or another thief; try again.
+    }
+}
 
-        task.render();
 
-        lck.lock();
+Worker::Worker (Job* job)
+    : job(job)
+{ }
+
+void Worker::loop ()
+{
+    // No tasks are added while the workers run, so once every deque is
+    // empty there is nothing left to do.
+    int index;
+    while (queue.pop(&index) || job->steal(this, &index)) {
+        Task& task = job->tasks[index];
+        task.render(arena);
         job->task_finished(task);
-        state = IDLE;
-        lck.unlock();
-        job->prod_cv.notify_all();
     }
 }
 
@@ -4,11 +4,15 @@
 #include <memory>
 #include <thread>
 #include <mutex>
-#include <condition_variable>
+#include <functional>
+#include <vector>
 #include <atomic>
 #include "film.hpp"
+#include "arena.hpp"
 
 class Scene;
+class SurfaceIntegrator;
+class SampleGenerator;
 
 namespace threaded_render {
 
@@ -17,32 +21,53 @@ class TaskDesc;
 class Task;
 class Worker;
 
+/// Renders tiles with a pool of threads. Every worker has a deque of
+/// tasks; it works through its own deque and, once that runs dry, steals
+/// from the others. Neither taking nor finishing a task takes a lock.
 class Job
 {
 public:
     Job (int threads, const Scene& scene, Film& film);
+    /// Queues a task. All the tasks must be added before finish().
     void add_task (const TaskDesc&);
+    /// Renders the queued tasks and returns when all are done.
     void finish ();
 
+    /// The callback is called from the worker threads, one call at a time.
     void set_callback (std::function<void(const Task&)> cb);
+    /// Total time the workers have been held up by the callback, waiting
+    /// for their turn included.
+    double callback_seconds () const { return callback_ns * 1e-9; }
 
 public:
     const Scene& scene;
     Film& film;
-    std::mutex mtx;
-    std::condition_variable prod_cv;
 
     /// Called by task itself.
-    void task_finished (const Task&);
+    void task_finished (Task&);
 
-    std::vector<int> seeds;
+    /// The samples of a pixel depend only on these, the pixel's position
+    /// and the pass, so tiles can be rendered in any order and anywhere.
+    unsigned int seed;
+    /// Index of the frame of an animation.
+    int frame;
 private:
-    bool wait_for_finish;
-    std::vector<std::shared_ptr<Worker>> workers;
+    friend class Worker;
+
+    std::vector<Task> tasks;
+    std::vector<std::unique_ptr<Worker>> workers;
+    /// Worker that gets the next added task.
+    int next_worker;
+    bool running;
+
+    /// Takes a task from the deque of some other worker than #thief.
+    /// @return false if all the deques are empty
+    bool steal (const Worker* thief, int* index);
 
-    Worker* find_worker (int state);
-    bool any_pending () const;
     std::function<void(const Task&)> task_done_cb;
+    /// Serializes the calls to task_done_cb.
+    std::mutex cb_mtx;
+    std::atomic<long long> callback_ns;
 };
 
 class TaskDesc
@@ -52,34 +77,82 @@ public:
     int xres, yres;
     int spp;
     std::string sampler_name;
+    /// Width of the square blocks of camera rays traced as packets,
+    /// 0 for tracing one ray at a time.
+    int packet_size;
+    int max_depth;
+    int rr_depth;
+    /// "path" traces each sample on its own, "wavefront" advances all the
+    /// paths of a group of pixels one stage at a time.
+    std::string engine;
+    /// "direct" adds the samples straight to the job's film, "merge"
+    /// renders into a film of its own that is merged when the task is done.
+    std::string film_mode;
+    /// Index of the progressive pass. Each pass gets different samples.
+    int pass;
+    /// Samples per pixel rendered by the earlier passes, where the low
+    /// discrepancy sequences of the pixels carry on from.
+    int first_sample;
 };
 
 class Task : public TaskDesc
 {
 public:
     Job* job;
+    /// Film of the tile in merge mode.
     std::unique_ptr<Film> film;
+    /// Where the samples go.
+    FilmTile tile;
 
     Task () {}
     Task (Job*, const TaskDesc& desc);
 
-    void render ();
+    /// @par arena  Scratch memory of the calling thread, reset after
+    ///             each sample.
+    void render (MemoryArena& arena);
+
+private:
+    /// Seed of the sample generator of pixel (gx,gy) of the film: a hash
+    /// of the pixel, the pass and the job's frame and seed.
+    uint64_t pixel_seed (int gx, int gy, int pass) const;
+    /// Seeds #rng and generates the sample sets of pixel (gx,gy) for this
+    /// pass.
+    void start_pixel (SampleGenerator* sampler, Pcg32* rng, int gx, int gy) const;
+
+    void render_packets (SurfaceIntegrator* surf_integ, MemoryArena& arena);
+    void render_wavefront (MemoryArena& arena);
+};
+
+SampleGenerator* make_sampler (const std::string& name, int spp);
+
+/// Chase-Lev deque of task indices. The owning worker pushes and pops at
+/// the bottom, other workers steal from the top. Pushing is only allowed
+/// before the workers have started.
+class WorkDeque
+{
+public:
+    WorkDeque () : top(0), bottom(0) {}
+
+    void push (int index);
+    /// Called by the owner only.
+    bool pop (int* index);
+    /// May be called by any thread.
+    bool steal (int* index);
+
+private:
+    std::vector<int> buffer;
+    std::atomic<long> top;
+    std::atomic<long> bottom;
 };
 
 class Worker
 {
 public:
     Job* job;
-    enum {
-        IDLE,
-        INPUT_READY,
-        WORKING,
-        QUIT
-    };
     std::thread th;
-    Task task;
-    std::atomic<int> state;
-    std::condition_variable cv;
+    WorkDeque queue;
+    /// Holds the BSDFs of the sample being rendered by this thread.
+    MemoryArena arena;
 
     Worker (Job* job);
     void loop ();
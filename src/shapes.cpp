@@ -1,6 +1,16 @@
 #include "gray.hpp"
 #include "lisc.hpp"
 #include "util.hpp"
+#include "distribution.hpp"
+#include "ply.hpp"
+#include "mappedfile.hpp"
+#include "timer.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
 
 BBox::BBox ()
     : min(vec3(99999)), max(vec3(-99999))
@@ -20,6 +30,35 @@ void BBox::extend (const vec3& v)
     if (v.z > max.z) max.z = v.z;
 }
 
+void BBox::extend (const BBox& b)
+{
+    extend(b.min);
+    extend(b.max);
+}
+
+bool BBox::is_finite () const
+{
+    for (int k = 0; k < 3; k++) {
+        if (std::isinf(min[k]) || std::isinf(max[k])) return false;
+    }
+    return true;
+}
+
+BBox BBox::transform (const Transform& xform) const
+{
+    if (!is_finite()) {
+        const float inf = std::numeric_limits<float>::infinity();
+        return BBox(vec3(-inf), vec3(inf));
+    }
+    BBox b;
+    for (int i = 0; i < 8; i++) {
+        b.extend(xform.point(vec3((i & 1) ? max.x : min.x,
+                                  (i & 2) ? max.y : min.y,
+                                  (i & 4) ? max.z : min.z)));
+    }
+    return b;
+}
+
 bool BBox::intersect (const Ray& ray) const
 {
     // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-7-intersecting-simple-shapes/ray-box-intersection/
@@ -53,11 +92,45 @@ class Sphere : public Shape
 public:
     bool intersect (Ray& r, Isect* isect, bool self, bool inside_self);
 
+    bool occluded (const Ray& ray, bool self, bool inside_self)
+    {
+        float t;
+        return hit(ray, self, inside_self, &t);
+    }
+
     BBox get_bbox () const { return BBox(vec3(-1), vec3(1)); }
+
+    float area () const { return 2 * M_2PI; }
+
+    vec3 sample (const vec2& u, vec3* n) const
+    {
+        float z = 1 - 2 * u[0];
+        float r = sqrtf(std::max(0.0f, 1 - z*z));
+        float phi = u[1] * M_2PI;
+        *n = vec3(cos(phi)*r, sin(phi)*r, z);
+        return *n;
+    }
+
+private:
+    /// Finds the distance to the hit, if any.
+    bool hit (const Ray& ray, bool self, bool inside_self, float* t) const;
 };
 
 
 bool Sphere::intersect (Ray& ray, Isect* isect, bool self, bool inside_self)
+{
+    float t;
+    if (!hit(ray, self, inside_self, &t)) return false;
+
+    ray.tmax = t;
+    isect->p = ray.o + t*ray.d;
+    isect->n = normalize(isect->p);
+    isect->ng = isect->n;
+
+    return true;
+}
+
+bool Sphere::hit (const Ray& ray, bool self, bool inside_self, float* t) const
 {
     if (self && !inside_self) return false;
 
@@ -79,21 +152,14 @@ bool Sphere::intersect (Ray& ray, Isect* isect, bool self, bool inside_self)
     float t1 = (-B + sqrtf(discrim)) / (2*A);
     if (t0 > t1) std::swap(t0, t1);
 
-    float t;
     if (!self) {
-        t = (t0 >= ray.tmin) ? t0 : t1;
+        *t = (t0 >= ray.tmin) ? t0 : t1;
     }
     else {
-        t = inside_self ? t1 : t0;
+        *t = inside_self ? t1 : t0;
     }
 
-    if (t < ray.tmin || t > ray.tmax) return false;
-
-    ray.tmax = t;
-    isect->p = o + t*d;
-    isect->n = normalize(isect->p);
-
-    return true;
+    return *t >= ray.tmin && *t <= ray.tmax;
 }
 
 
@@ -113,10 +179,18 @@ public:
         ray.tmax = t;
         isect->p = ray.o + t*ray.d;
         isect->n = vec3(0,1,0);
+        isect->ng = isect->n;
 
         return true;
     }
 
+    bool occluded (const Ray& ray, bool self, bool inside_self)
+    {
+        if (self || ray.d.y == 0) return false;
+        float t = -ray.o.y / ray.d.y;
+        return t >= ray.tmin && t <= ray.tmax;
+    }
+
     BBox get_bbox () const
     {
         const float inf = std::numeric_limits<double>::infinity();
@@ -144,12 +218,29 @@ public:
         ray.tmax = t;
         isect->p = p;
         isect->n = vec3(0,1,0);
+        isect->ng = isect->n;
 
         return true;
     }
 
+    bool occluded (const Ray& ray, bool self, bool inside_self)
+    {
+        if (self || ray.d.y == 0) return false;
+        float t = -ray.o.y / ray.d.y;
+        if (t < ray.tmin || t > ray.tmax) return false;
+        vec3 p = ray.o + t*ray.d;
+        return p.x >= -1 && p.x <= 1 && p.z >= -1 && p.z <= 1;
+    }
+
     BBox get_bbox () const { return BBox(vec3(-1,0,-1), vec3(1,0,1)); }
 
+    float area () const { return 4; }
+
+    vec3 sample (const vec2& u, vec3* n) const
+    {
+        *n = vec3(0,1,0);
+        return vec3(2*u[0] - 1, 0, 2*u[1] - 1);
+    }
 };
 
 
@@ -157,6 +248,30 @@ class Box : public Shape
 {
 public:
     bool intersect (Ray& ray, Isect* isect, bool self, bool inside_self)
+    {
+        float t;
+        if (!hit(ray, self, inside_self, &t)) return false;
+
+        ray.tmax = t;
+        isect->p = ray.o + ray.d * t;
+        int k = abs_max_elem(isect->p);
+        isect->n = vec3(0.0f);
+        isect->n[k] = (isect->p[k] < 0) ? -1.0f : 1.0f;
+        isect->ng = isect->n;
+        return true;
+    }
+
+    bool occluded (const Ray& ray, bool self, bool inside_self)
+    {
+        float t;
+        return hit(ray, self, inside_self, &t);
+    }
+
+    BBox get_bbox () const { return BBox(vec3(-1), vec3(1)); }
+
+private:
+    /// Finds the distance to the hit, if any.
+    bool hit (const Ray& ray, bool self, bool inside_self, float* t) const
     {
         // float tt[7];
         // for (int k = 0; k < 3; k++) {
@@ -204,37 +319,72 @@ public:
 
         // float t = tmin;
         // if (tmin < ray.tmin) t = tmax;
-        float t;
         if (!self) {
-            t = (tmin >= ray.tmin) ? tmin : tmax;
+            *t = (tmin >= ray.tmin) ? tmin : tmax;
         }
         else {
-            t = inside_self ? tmax : tmin;
+            *t = inside_self ? tmax : tmin;
         }
-        if (t < ray.tmin || t > ray.tmax) return false;
-
-        ray.tmax = t;
-        isect->p = ray.o + ray.d * t;
-        int k = abs_max_elem(isect->p);
-        isect->n = vec3(0.0f);
-        isect->n[k] = (isect->p[k] < 0) ? -1.0f : 1.0f;
         // if (ray.tmin < tmin) ray.tmin = tmin;
         // if (ray.tmax > tmax) ray.tmax = tmax;
-        return true;
-
-
+        return *t >= ray.tmin && *t <= ray.tmax;
     }
-
-    BBox get_bbox () const { return BBox(vec3(-1), vec3(1)); }
 };
 
 
+/// Picks a point uniformly by area on the triangle abc.
+static inline
+vec3 sample_triangle (const vec3& a, const vec3& b, const vec3& c, const vec2& u)
+{
+    float su = sqrtf(u[0]);
+    float b0 = 1 - su;
+    float b1 = u[1] * su;
+    return a * b0 + b * b1 + c * (1 - b0 - b1);
+}
+
+
 class Triangle : public Shape
 {
 public:
     vec3 v[3];
 
     bool intersect (Ray& ray, Isect* isect, bool self, bool inside_self)
+    {
+        float t;
+        if (!hit(ray, self, &t)) return false;
+
+        ray.tmax = t;
+        isect->p = ray.o + t * ray.d;
+        isect->n = normalize(cross(v[1] - v[0], v[2] - v[0]));
+        isect->ng = isect->n;
+
+        return true;
+    }
+
+    bool occluded (const Ray& ray, bool self, bool inside_self)
+    {
+        float t;
+        return hit(ray, self, &t);
+    }
+
+    BBox get_bbox () const
+    {
+        BBox b;
+        for (int i = 0; i < 3; i++) b.extend(v[i]);
+        return b;
+    }
+
+    float area () const { return 0.5f * length(cross(v[1] - v[0], v[2] - v[0])); }
+
+    vec3 sample (const vec2& u, vec3* n) const
+    {
+        *n = normalize(cross(v[1] - v[0], v[2] - v[0]));
+        return sample_triangle(v[0], v[1], v[2], u);
+    }
+
+private:
+    /// Finds the distance to the hit, if any.
+    bool hit (const Ray& ray, bool self, float* t) const
     {
         if (self) return false; // A plane cannot be hit twice by the same ray.
 
@@ -265,18 +415,9 @@ public:
         if (v < 0 || v > 1 || u + v > 1) return false;
 
         // Calculate t.
-        float t = dot(e2, qvec) * inv_det;
-        if (t < ray.tmin || t > ray.tmax) return false;
-
-        // Hit.
-        ray.tmax = t;
-        isect->p = ray.o + t * ray.d;
-        isect->n = normalize(cross(e1, e2));
-
-        return true;
+        *t = dot(e2, qvec) * inv_det;
+        return *t >= ray.tmin && *t <= ray.tmax;
     }
-
-    BBox get_bbox () const { return BBox(vec3(-1,0,-1), vec3(1,0,1)); }
 };
 
 
@@ -288,9 +429,35 @@ public:
     std::vector<int> vertex_indices;
     bool smooth;
     BBox bbox;
+    /// Picks faces in proportion to their area, see calculate_areas.
+    std::unique_ptr<Distribution1D> face_distribution;
+    float total_area;
+
+    Mesh () : smooth(false), total_area(0) {}
 
     BBox get_bbox () const { return bbox; }
 
+    float area () const { return total_area; }
+
+    vec3 sample (const vec2& u, vec3* n) const
+    {
+        float pdf;
+        int face;
+        float x = face_distribution->sample(u[0], &pdf, &face);
+        // Stretch the part of u[0] within the face's piece back to [0,1).
+        vec2 uf(x * face_distribution->size() - face, u[1]);
+        const vec3& a = vertex(face, 0);
+        const vec3& b = vertex(face, 1);
+        const vec3& c = vertex(face, 2);
+        *n = normalize(cross(b - a, c - a));
+        return sample_triangle(a, b, c, uf);
+    }
+
+    const vec3& vertex (int face, int v) const
+    {
+        return vertices[vertex_indices[face*3+v]];
+    }
+
     vec3& vertex (int face, int v)
     {
         return vertices[vertex_indices[face*3+v]];
@@ -310,6 +477,45 @@ public:
         return hit;
     }
 
+    virtual bool occluded (const Ray& ray, bool self, bool inside_self)
+    {
+        for (unsigned int i = 0; i < vertex_indices.size()/3; ++i) {
+            if (occluded_triangle(i, ray, self, inside_self)) return true;
+        }
+        return false;
+    }
+
+    /// The hit test of intersect_triangle alone, without the normals.
+    bool occluded_triangle (int triangle, const Ray& ray, bool self, bool inside_self) const
+    {
+        const vec3& vert0 = vertex(triangle, 0);
+        vec3 e1 = vertex(triangle, 1) - vert0;
+        vec3 e2 = vertex(triangle, 2) - vert0;
+        vec3 pvec = cross(ray.d, e2);
+        float det = dot(e1, pvec);
+        if (det == 0) return false;
+        float inv_det = 1 / det;
+
+        vec3 tvec = ray.o - vert0;
+        float u = dot(tvec, pvec) * inv_det;
+        if (u < 0 || u > 1) return false;
+
+        vec3 qvec = cross(tvec, e1);
+        float v = dot(ray.d, qvec) * inv_det;
+        if (v < 0 || v > 1 || u + v > 1) return false;
+
+        float t = dot(e2, qvec) * inv_det;
+        if (t < ray.tmin || t > ray.tmax) return false;
+
+        // Self-shadowing, as in intersect_triangle. Only the sign of the
+        // dot product matters, so the normal needn't be normalized.
+        if (self) {
+            bool new_inside = ( dot(ray.d, cross(e1, e2)) > 0 );
+            if (inside_self != new_inside) return false;
+        }
+        return true;
+    }
+
     bool intersect_triangle (int triangle, Ray& ray, Isect* isect, bool self, bool inside_self)
     {
         const vec3& vert0 = vertex(triangle, 0);
@@ -361,6 +567,7 @@ public:
         // Hit.
         ray.tmax = t;
         isect->p = ray.o + t * ray.d;
+        isect->ng = n_geom;
         if (smooth) {
             const vec3& n0 = normal(triangle, 0);
             const vec3& n1 = normal(triangle, 1);
@@ -381,6 +588,21 @@ public:
         return true;
     }
 
+    /// Sets up area sampling. Must be called again whenever the vertices
+    /// or the order of the faces change.
+    void calculate_areas ()
+    {
+        int fcount = vertex_indices.size() / 3;
+        std::vector<float> areas(fcount);
+        total_area = 0;
+        for (int i = 0; i < fcount; i++) {
+            areas[i] = 0.5f * length(cross(vertex(i,1) - vertex(i,0),
+                                           vertex(i,2) - vertex(i,0)));
+            total_area += areas[i];
+        }
+        face_distribution.reset(fcount > 0 ? new Distribution1D(&areas[0], fcount) : nullptr);
+    }
+
     void calculate_bbox ()
     {
         for (auto& v : vertices) {
@@ -437,183 +659,1016 @@ public:
 };
 
 
-class BVHNode
+/// Node of a flattened BVH. Nodes are stored depth first, so the first child
+/// of an interior node directly follows it.
+struct LinearBVHNode
 {
-public:
     BBox bbox;
-    std::vector<int> faces;
-    std::vector<BVHNode*> children;
-    Mesh* mesh;
+    /// Leaf: index of the first face. Interior: index of the second child.
+    int32_t offset;
+    /// Number of faces, zero for interior nodes.
+    uint16_t count;
+    /// Split axis of an interior node.
+    uint8_t axis;
+    uint8_t pad;
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+/// Node of a wide BVH with up to N children. The child bounds are stored as
+/// a structure of arrays so that all children can be tested at once.
+template<int N>
+struct WideBVHNode
+{
+    /// Child bounds: min x, y, z followed by max x, y, z.
+    float bounds[6][N];
+    /// Leaf: index of the first face. Interior: index of the child node.
+    int32_t offset[N];
+    /// Number of faces for leaves, zero for interior nodes.
+    uint16_t count[N];
+    /// Children are packed to the front.
+    int nchildren;
+};
+
+/// Deepest a mesh BVH gets, counting interior nodes from the root. The
+/// traversals keep their pending nodes on fixed stacks of this size.
+constexpr int max_bvh_depth = 64;
+/// Below this depth, nodes are split at the median instead of by SAH.
+/// Halving at most 2^31 faces takes 31 more levels, which keeps the
+/// tree within max_bvh_depth however unbalanced the SAH splits are.
+constexpr int max_sah_depth = max_bvh_depth - 32;
+
+// Builds without -mavx still get the 8-wide box test on CPUs that have
+// AVX: it is compiled for AVX on its own, and picked at run time.
+#if !defined(__AVX__) && defined(__SSE__) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define BVH_AVX_DISPATCH 1
+#endif
+
+static bool cpu_has_avx ()
+{
+#if defined(__AVX__)
+    return true;
+#elif defined(BVH_AVX_DISPATCH)
+    // May run from static initializers, before the CPU model is set up.
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx");
+#else
+    return false;
+#endif
+}
+
+static const bool use_avx = cpu_has_avx();
+
+/// Widest BVH the SIMD box tests support on this CPU.
+static const int default_bvh_width = use_avx ? 8 :
+#if defined(__SSE__)
+    4;
+#else
+    2;
+#endif
+
+/// Slab test against all children of a wide node. Scalar fallback for
+/// widths without a SIMD specialization in this build.
+/// @param tnear [out] entry distance for each child
+/// @return bit mask of the children hit
+template<int N>
+inline
+int intersect_children (const WideBVHNode<N>& node, const Ray& ray,
+                        const vec3& inv_d, float* tnear)
+{
+    int mask = 0;
+    for (int i = 0; i < node.nchildren; i++) {
+        float t0 = ray.tmin;
+        float t1 = ray.tmax;
+        for (int k = 0; k < 3; k++) {
+            float a = (node.bounds[k][i] - ray.o[k]) * inv_d[k];
+            float b = (node.bounds[k+3][i] - ray.o[k]) * inv_d[k];
+            if (a > b) std::swap(a, b);
+            t0 = a > t0 ? a : t0;
+            t1 = b < t1 ? b : t1;
+        }
+        tnear[i] = t0;
+        if (t0 <= t1) mask |= 1 << i;
+    }
+    return mask;
+}
 
-    const vec3& vertex (int face, int i) const
+#if defined(__SSE__)
+template<>
+inline
+int intersect_children<4> (const WideBVHNode<4>& node, const Ray& ray,
+                           const vec3& inv_d, float* tnear)
+{
+    __m128 t0 = _mm_set1_ps(ray.tmin);
+    __m128 t1 = _mm_set1_ps(ray.tmax);
+    for (int k = 0; k < 3; k++) {
+        __m128 o = _mm_set1_ps(ray.o[k]);
+        __m128 id = _mm_set1_ps(inv_d[k]);
+        __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[k]), o), id);
+        __m128 b = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[k+3]), o), id);
+        t0 = _mm_max_ps(t0, _mm_min_ps(a, b));
+        t1 = _mm_min_ps(t1, _mm_max_ps(a, b));
+    }
+    _mm_storeu_ps(tnear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << node.nchildren) - 1);
+}
+#endif
+
+#if defined(__AVX__) || defined(BVH_AVX_DISPATCH)
+#if defined(BVH_AVX_DISPATCH)
+__attribute__((target("avx")))
+#endif
+inline
+int intersect_children_avx (const WideBVHNode<8>& node, const Ray& ray,
+                            const vec3& inv_d, float* tnear)
+{
+    __m256 t0 = _mm256_set1_ps(ray.tmin);
+    __m256 t1 = _mm256_set1_ps(ray.tmax);
+    for (int k = 0; k < 3; k++) {
+        __m256 o = _mm256_set1_ps(ray.o[k]);
+        __m256 id = _mm256_set1_ps(inv_d[k]);
+        __m256 a = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[k]), o), id);
+        __m256 b = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[k+3]), o), id);
+        t0 = _mm256_max_ps(t0, _mm256_min_ps(a, b));
+        t1 = _mm256_min_ps(t1, _mm256_max_ps(a, b));
+    }
+    _mm256_storeu_ps(tnear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & ((1 << node.nchildren) - 1);
+}
+#endif
+
+#if defined(__AVX__)
+template<>
+inline
+int intersect_children<8> (const WideBVHNode<8>& node, const Ray& ray,
+                           const vec3& inv_d, float* tnear)
+{
+    return intersect_children_avx(node, ray, inv_d, tnear);
+}
+#endif
+
+/// Box test of the wide traversals: intersect_children of this build.
+struct ChildrenTest
+{
+    template<int N>
+    static int test (const WideBVHNode<N>& node, const Ray& ray, const vec3& inv_d, float* tnear)
     {
-        return mesh->vertices[mesh->vertex_indices[face*3+i]];
+        return intersect_children(node, ray, inv_d, tnear);
     }
+};
 
-    BVHNode () {}
-    BVHNode (Mesh* m)
-        : mesh(m)
-    { }
+#if defined(BVH_AVX_DISPATCH)
+/// Box test of the traversals that BVHMesh compiles for AVX.
+struct ChildrenTestAvx
+{
+    __attribute__((target("avx")))
+    static int test (const WideBVHNode<8>& node, const Ray& ray, const vec3& inv_d, float* tnear)
+    {
+        return intersect_children_avx(node, ray, inv_d, tnear);
+    }
+};
+#endif
+
+class BVHMesh : public Mesh
+{
+public:
+    /// Branching factor: 2, 4 or 8.
+    int width;
+    std::vector<LinearBVHNode> nodes;
+    std::vector<WideBVHNode<4>> nodes4;
+    std::vector<WideBVHNode<8>> nodes8;
+
+    BVHMesh () : width(default_bvh_width) {}
+
+    /// Builds the hierarchy with the surface area heuristic, and collapses
+    /// it into a wide BVH unless width is 2.
+    /// Faces are reordered so that each leaf refers to a contiguous range.
+    void build ();
+
+    /// Number of nodes of the hierarchy of this width.
+    size_t node_count () const
+    {
+        switch (width) {
+            case 4: return nodes4.size();
+            case 8: return nodes8.size();
+            default: return nodes.size();
+        }
+    }
 
     bool intersect (Ray& ray, Isect* isect, bool self, bool inside_self)
     {
-        if (!bbox.intersect(ray)) return false;
-        bool hit = false;
-        for (auto* n : children) {
-            hit |= n->intersect(ray, isect, self, inside_self);
+        switch (width) {
+            case 4: return intersect_wide(nodes4, ray, isect, self, inside_self);
+            case 8:
+#if defined(BVH_AVX_DISPATCH)
+                if (use_avx) return intersect_wide8_avx(ray, isect, self, inside_self);
+#endif
+                return intersect_wide(nodes8, ray, isect, self, inside_self);
+            default: return intersect_binary(ray, isect, self, inside_self);
         }
-        for (unsigned int i = 0; i < faces.size(); i++) {
-            hit |= mesh->intersect_triangle(faces[i], ray, isect, self, inside_self);
+    }
+
+    bool intersect_binary (Ray& ray, Isect* isect, bool self, bool inside_self)
+    {
+        if (nodes.empty()) return false;
+
+        vec3 inv_d(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+
+        // Visit the child nearer to the ray origin first, so that
+        // ray.tmax shrinks early and prunes the farther subtree.
+        int stack[max_bvh_depth];
+        int top = 0;
+        int i = 0;
+        bool hit = false;
+        while (true) {
+            const LinearBVHNode& node = nodes[i];
+            if (node.bbox.intersect(ray, inv_d)) {
+                if (node.count > 0) {
+                    for (int k = 0; k < node.count; k++) {
+                        hit |= intersect_triangle(node.offset + k, ray, isect, self, inside_self);
+                    }
+                }
+                else if (inv_d[node.axis] < 0) {
+                    stack[top++] = i + 1;
+                    i = node.offset;
+                    continue;
+                }
+                else {
+                    stack[top++] = node.offset;
+                    i = i + 1;
+                    continue;
+                }
+            }
+            if (top == 0) break;
+            i = stack[--top];
         }
         return hit;
     }
 
-    void add (int face)
+#if defined(BVH_AVX_DISPATCH)
+    // The 8-wide traversals compiled for AVX. flatten inlines the whole
+    // loop, AVX box test included, into them.
+
+    __attribute__((target("avx"), flatten))
+    bool intersect_wide8_avx (Ray& ray, Isect* isect, bool self, bool inside_self)
     {
-        faces.push_back(face);
-        bbox.extend(vertex(face, 0));
-        bbox.extend(vertex(face, 1));
-        bbox.extend(vertex(face, 2));
+        return intersect_wide<8, ChildrenTestAvx>(nodes8, ray, isect, self, inside_self);
     }
 
-    void split ()
+    __attribute__((target("avx"), flatten))
+    bool occluded_wide8_avx (const Ray& ray, bool self, bool inside_self) const
     {
-        if (faces.size() <= 32) return;
-        int axis = abs_max_elem(bbox.max - bbox.min);
-        float th = (bbox.max[axis] + bbox.min[axis]) / 2;
+        return occluded_wide<8, ChildrenTestAvx>(nodes8, ray, self, inside_self);
+    }
+#endif
 
-        BVHNode* left = new BVHNode(mesh);
-        BVHNode* right = new BVHNode(mesh);
-        // for (unsigned int i = 0; i < faces.size(); i++) {
-        for (int i : faces) {
-            bool go_left = false;
-            bool go_right = false;
-            for (int k = 0; k < 3; k++) {
-                if (vertex(i,k)[axis] < th) go_left = true;
-                if (vertex(i,k)[axis] >= th) go_right = true;
+    template<int N, typename Test = ChildrenTest>
+    bool intersect_wide (const std::vector<WideBVHNode<N>>& wnodes,
+                         Ray& ray, Isect* isect, bool self, bool inside_self)
+    {
+        if (wnodes.empty()) return false;
+
+        vec3 inv_d(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+
+        struct Entry
+        {
+            int offset;
+            int count;
+            float tnear;
+        };
+        // Each level pushes at most N-1 more entries than it pops.
+        Entry stack[max_bvh_depth * N];
+        int top = 0;
+        stack[top++] = Entry{0, 0, ray.tmin};
+        bool hit = false;
+        while (top > 0) {
+            Entry e = stack[--top];
+            if (e.tnear > ray.tmax) continue;
+            if (e.count > 0) {
+                for (int k = 0; k < e.count; k++) {
+                    hit |= intersect_triangle(e.offset + k, ray, isect, self, inside_self);
+                }
+                continue;
             }
-            if (go_left) left->add(i);
-            if (go_right) right->add(i);
-            if (!go_left && !go_right) {
-                std::cout << "split FAILED: a face not in left or right child!\n";
+
+            const WideBVHNode<N>& node = wnodes[e.offset];
+            float tnear[N];
+            int mask = Test::test(node, ray, inv_d, tnear);
+
+            // Push the hit children sorted so that the nearest is on top.
+            int first = top;
+            for (int k = 0; k < N; k++) {
+                if (!(mask & (1 << k))) continue;
+                Entry c{node.offset[k], node.count[k], tnear[k]};
+                int j = top++;
+                while (j > first && stack[j-1].tnear < c.tnear) {
+                    stack[j] = stack[j-1];
+                    j--;
+                }
+                stack[j] = c;
             }
         }
-        if (left->faces.size() == 0 || right->faces.size() == 0 ||
-            left->faces.size() == faces.size() || right->faces.size() == faces.size()) {
-            // could not partition
-            delete left;
-            delete right;
-            return;
+        return hit;
+    }
+
+    bool occluded (const Ray& ray, bool self, bool inside_self)
+    {
+        switch (width) {
+            case 4: return occluded_wide(nodes4, ray, self, inside_self);
+            case 8:
+#if defined(BVH_AVX_DISPATCH)
+                if (use_avx) return occluded_wide8_avx(ray, self, inside_self);
+#endif
+                return occluded_wide(nodes8, ray, self, inside_self);
+            default: return occluded_binary(ray, self, inside_self);
         }
-        children.push_back(left);
-        children.push_back(right);
-        // std::cout << "split "<<faces.size()<<" to "<<left->faces.size()<<"+"<<right->faces.size()<<"\n";
-        faces.clear();
-        left->split();
-        right->split();
     }
 
-    int calc ()
+    /// Same traversal as intersect_binary, but returns at the first hit.
+    bool occluded_binary (const Ray& ray, bool self, bool inside_self) const
     {
-        int cnt = 0;
-        for (auto* n : children) {
-            cnt += n->calc();
+        if (nodes.empty()) return false;
+
+        vec3 inv_d(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+
+        int stack[max_bvh_depth];
+        int top = 0;
+        int i = 0;
+        while (true) {
+            const LinearBVHNode& node = nodes[i];
+            if (node.bbox.intersect(ray, inv_d)) {
+                if (node.count > 0) {
+                    for (int k = 0; k < node.count; k++) {
+                        if (occluded_triangle(node.offset + k, ray, self, inside_self)) return true;
+                    }
+                }
+                else {
+                    stack[top++] = node.offset;
+                    i = i + 1;
+                    continue;
+                }
+            }
+            if (top == 0) break;
+            i = stack[--top];
         }
-        cnt += faces.size();
-        return cnt;
+        return false;
     }
 
-    void plot (std::vector<int>& cnts)
+    /// Same traversal as intersect_wide, but returns at the first hit.
+    /// tmax never shrinks, so the children are not sorted.
+    template<int N, typename Test = ChildrenTest>
+    bool occluded_wide (const std::vector<WideBVHNode<N>>& wnodes,
+                        const Ray& ray, bool self, bool inside_self) const
     {
-        for (auto* n : children) {
-            n->plot(cnts);
+        if (wnodes.empty()) return false;
+
+        vec3 inv_d(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+
+        struct Entry
+        {
+            int offset;
+            int count;
+        };
+        Entry stack[max_bvh_depth * N];
+        int top = 0;
+        stack[top++] = Entry{0, 0};
+        while (top > 0) {
+            Entry e = stack[--top];
+            if (e.count > 0) {
+                for (int k = 0; k < e.count; k++) {
+                    if (occluded_triangle(e.offset + k, ray, self, inside_self)) return true;
+                }
+                continue;
+            }
+
+            const WideBVHNode<N>& node = wnodes[e.offset];
+            float tnear[N];
+            int mask = Test::test(node, ray, inv_d, tnear);
+            for (int k = 0; k < N; k++) {
+                if (mask & (1 << k)) stack[top++] = Entry{node.offset[k], node.count[k]};
+            }
         }
-        for (unsigned int i = 0; i < faces.size(); i++) {
-            cnts[faces[i]]++;
+        return false;
+    }
+
+    void intersect_packet (RayPacket& packet, int first, Isect* isects, bool* hits)
+    {
+        switch (width) {
+            case 4: intersect_packet_wide(nodes4, packet, first, isects, hits); break;
+            case 8: intersect_packet_wide(nodes8, packet, first, isects, hits); break;
+            default: intersect_packet_binary(packet, first, isects, hits); break;
         }
+    }
 
+    /// Intersects the rays from #first on that hit the leaf box #b.
+    void intersect_packet_leaf (const BBox& b, int offset, int count,
+                                RayPacket& packet, int first, Isect* isects, bool* hits)
+    {
+        for (int i = first; i < packet.size; i++) {
+            Ray& ray = packet.rays[i];
+            if (!b.intersect(ray, packet.inv_d[i])) continue;
+            for (int k = 0; k < count; k++) {
+                hits[i] |= intersect_triangle(offset + k, ray, &isects[i], false, false);
+            }
+        }
     }
-};
 
-class BVHMesh : public Mesh
-{
-public:
-    BVHNode root;
-    bool intersect (Ray& ray, Isect* isect, bool self, bool inside_self)
+    // Packet traversals carry along the first ray that hit the parent box;
+    // the rays before it can be skipped in the whole subtree.
+
+    void intersect_packet_binary (RayPacket& packet, int first, Isect* isects, bool* hits)
     {
-        return root.intersect(ray, isect, self, inside_self);
+        if (nodes.empty()) return;
+
+        struct Entry
+        {
+            int node;
+            int first;
+        };
+        Entry stack[max_bvh_depth];
+        int top = 0;
+        stack[top++] = Entry{0, first};
+        while (top > 0) {
+            Entry e = stack[--top];
+            const LinearBVHNode& node = nodes[e.node];
+            int f = packet.first_hit(node.bbox, e.first);
+            if (f == packet.size) continue;
+
+            if (node.count > 0) {
+                intersect_packet_leaf(node.bbox, node.offset, node.count, packet, f, isects, hits);
+            }
+            else if (packet.rays[f].d[node.axis] < 0) {
+                stack[top++] = Entry{e.node + 1, f};
+                stack[top++] = Entry{node.offset, f};
+            }
+            else {
+                stack[top++] = Entry{node.offset, f};
+                stack[top++] = Entry{e.node + 1, f};
+            }
+        }
     }
 
+    template<int N>
+    void intersect_packet_wide (const std::vector<WideBVHNode<N>>& wnodes,
+                                RayPacket& packet, int first, Isect* isects, bool* hits)
+    {
+        if (wnodes.empty()) return;
+
+        struct Entry
+        {
+            int node;
+            int first;
+            float dist;
+        };
+        Entry stack[max_bvh_depth * N];
+        int top = 0;
+        stack[top++] = Entry{0, first, 0};
+        while (top > 0) {
+            Entry e = stack[--top];
+            const WideBVHNode<N>& node = wnodes[e.node];
+
+            int pushed = top;
+            for (int k = 0; k < node.nchildren; k++) {
+                BBox b(vec3(node.bounds[0][k], node.bounds[1][k], node.bounds[2][k]),
+                       vec3(node.bounds[3][k], node.bounds[4][k], node.bounds[5][k]));
+                int f = packet.first_hit(b, e.first);
+                if (f == packet.size) continue;
+
+                if (node.count[k] > 0) {
+                    intersect_packet_leaf(b, node.offset[k], node.count[k], packet, f, isects, hits);
+                    continue;
+                }
+
+                // Order the interior children front to back along the
+                // first active ray.
+                const Ray& r = packet.rays[f];
+                Entry c{node.offset[k], f, dot(b.center() - r.o, r.d)};
+                int j = top++;
+                while (j > pushed && stack[j-1].dist < c.dist) {
+                    stack[j] = stack[j-1];
+                    j--;
+                }
+                stack[j] = c;
+            }
+        }
+    }
+
+private:
+    struct BuildFace
+    {
+        BBox bbox;
+        vec3 centroid;
+        int face;
+    };
+
+    int build (std::vector<BuildFace>& faces, int begin, int end, int depth);
+
+    template<int N>
+    int collapse (int binary_index, std::vector<WideBVHNode<N>>& wnodes) const;
 };
 
+void BVHMesh::build ()
+{
+    int fcount = vertex_indices.size() / 3;
+    std::vector<BuildFace> faces(fcount);
+    for (int i = 0; i < fcount; i++) {
+        for (int k = 0; k < 3; k++) faces[i].bbox.extend(vertex(i, k));
+        faces[i].centroid = faces[i].bbox.center();
+        faces[i].face = i;
+    }
+
+    nodes.clear();
+    if (fcount == 0) return;
+    nodes.reserve(2 * fcount);
+    build(faces, 0, fcount, 0);
+    nodes.shrink_to_fit();
+
+    // Reorder the faces to match the leaves.
+    std::vector<int> indices(vertex_indices.size());
+    for (int i = 0; i < fcount; i++) {
+        for (int k = 0; k < 3; k++) {
+            indices[i*3+k] = vertex_indices[faces[i].face*3+k];
+        }
+    }
+    vertex_indices.swap(indices);
+
+    if (width == 4) {
+        collapse(0, nodes4);
+        nodes.clear();
+        nodes.shrink_to_fit();
+    }
+    else if (width == 8) {
+        collapse(0, nodes8);
+        nodes.clear();
+        nodes.shrink_to_fit();
+    }
+}
 
-#include <fstream>
-BVHMesh* load_ply (std::ifstream& ifs, double floor=NAN, double height=NAN)
+/// Turns the binary subtree rooted at #binary_index into a wide node by
+/// repeatedly opening the interior child with the largest surface area
+/// until there are N children.
+template<int N>
+int BVHMesh::collapse (int binary_index, std::vector<WideBVHNode<N>>& wnodes) const
 {
-    auto* M = new BVHMesh();
-    // auto* M = new Mesh();
-
-    char buf[256];
-    ifs.getline(buf, 256);
-    if (buf != std::string("ply")) throw std::runtime_error("ply: bad magic");
-
-    int vcount = 0;
-    int fcount = 0;
-
-    std::string tok;
-    ifs >> tok;
-    while (tok != "end_header") {
-        if (tok == "element") {
-            ifs >> tok;
-            if (tok == "vertex") {
-                ifs >> vcount;
+    int kids[N];
+    int n = 0;
+    const LinearBVHNode& root = nodes[binary_index];
+    if (root.count > 0) {
+        kids[n++] = binary_index;
+    }
+    else {
+        kids[n++] = binary_index + 1;
+        kids[n++] = root.offset;
+        while (n < N) {
+            int best = -1;
+            float best_area = -1;
+            for (int k = 0; k < n; k++) {
+                const LinearBVHNode& c = nodes[kids[k]];
+                if (c.count == 0 && c.bbox.surface_area() > best_area) {
+                    best = k;
+                    best_area = c.bbox.surface_area();
+                }
             }
-            else {
-                ifs >> fcount;
+            if (best < 0) break;
+            int c = kids[best];
+            kids[best] = c + 1;
+            kids[n++] = nodes[c].offset;
+        }
+    }
+
+    int index = wnodes.size();
+    wnodes.push_back(WideBVHNode<N>());
+    for (int k = 0; k < N; k++) {
+        for (int j = 0; j < 3; j++) {
+            wnodes[index].bounds[j][k] = INFINITY;
+            wnodes[index].bounds[j+3][k] = -INFINITY;
+        }
+        wnodes[index].offset[k] = 0;
+        wnodes[index].count[k] = 0;
+    }
+    wnodes[index].nchildren = n;
+
+    for (int k = 0; k < n; k++) {
+        const LinearBVHNode& c = nodes[kids[k]];
+        int offset = (c.count > 0) ? c.offset : collapse(kids[k], wnodes);
+        // wnodes may have been reallocated by the recursion.
+        WideBVHNode<N>& w = wnodes[index];
+        for (int j = 0; j < 3; j++) {
+            w.bounds[j][k] = c.bbox.min[j];
+            w.bounds[j+3][k] = c.bbox.max[j];
+        }
+        w.offset[k] = offset;
+        w.count[k] = c.count;
+    }
+    return index;
+}
+
+int BVHMesh::build (std::vector<BuildFace>& faces, int begin, int end, int depth)
+{
+    // Relative cost of a node traversal compared to a triangle test.
+    constexpr float traversal_cost = 0.125f;
+    constexpr int max_leaf_faces = 8;
+    constexpr int nbins = 16;
+
+    int index = nodes.size();
+    nodes.push_back(LinearBVHNode());
+
+    BBox bbox;
+    BBox centroids;
+    for (int i = begin; i < end; i++) {
+        bbox.extend(faces[i].bbox);
+        centroids.extend(faces[i].centroid);
+    }
+    nodes[index].bbox = bbox;
+
+    int count = end - begin;
+    int axis = abs_max_elem(centroids.dim());
+    float extent = centroids.dim()[axis];
+
+    auto make_leaf = [&]() {
+        nodes[index].offset = begin;
+        nodes[index].count = count;
+        nodes[index].axis = 0;
+        return index;
+    };
+
+    int mid;
+    bool median_split = false;
+    if (count == 1) {
+        return make_leaf();
+    }
+    else if (extent == 0 || depth >= max_sah_depth) {
+        // All centroids coincide, so SAH can't separate them, or the SAH
+        // splits have been too unbalanced to keep going.
+        if (count <= max_leaf_faces) return make_leaf();
+        median_split = true;
+    }
+    else {
+        // Bin the centroids and evaluate the SAH at each bin boundary.
+        auto bin_of = [&](const BuildFace& f) {
+            int b = nbins * (f.centroid[axis] - centroids.min[axis]) / extent;
+            return std::min(b, nbins - 1);
+        };
+        BBox bin_bbox[nbins];
+        int bin_count[nbins] = {0};
+        for (int i = begin; i < end; i++) {
+            int b = bin_of(faces[i]);
+            bin_bbox[b].extend(faces[i].bbox);
+            bin_count[b]++;
+        }
+
+        // Sweep from the right to get the cost of the right hand side of
+        // each split, then from the left to find the cheapest split.
+        float right_cost[nbins];
+        BBox rb;
+        int rn = 0;
+        for (int b = nbins - 1; b > 0; b--) {
+            rb.extend(bin_bbox[b]);
+            rn += bin_count[b];
+            right_cost[b] = rn ? rn * rb.surface_area() : 0;
+        }
+        BBox lb;
+        int ln = 0;
+        int best_split = 1;
+        float best_cost = INFINITY;
+        for (int b = 1; b < nbins; b++) {
+            lb.extend(bin_bbox[b-1]);
+            ln += bin_count[b-1];
+            float cost = (ln ? ln * lb.surface_area() : 0) + right_cost[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_split = b;
             }
         }
-        else {
-            ifs.getline(buf, 256);
+        best_cost = traversal_cost + best_cost / bbox.surface_area();
+
+        if (count <= max_leaf_faces && count <= best_cost) {
+            return make_leaf();
         }
-        ifs >> tok;
+
+        mid = std::partition(faces.begin() + begin, faces.begin() + end,
+                             [&](const BuildFace& f) {
+                                 return bin_of(f) < best_split;
+                             }) - faces.begin();
+        median_split = (mid == begin || mid == end);
+    }
+
+    if (median_split) {
+        mid = (begin + end) / 2;
+        std::nth_element(faces.begin() + begin, faces.begin() + mid,
+                         faces.begin() + end,
+                         [&](const BuildFace& a, const BuildFace& b) {
+                             return a.centroid[axis] < b.centroid[axis];
+                         });
     }
-    // ifs.getline(buf, 256);
-    // if (buf != std::string("format ascii 1.0")) throw std::runtime_error("ply: bad format");
-    // ifs.getline(buf, 256);
-    // if (buf != std::string("format ascii 1.0")) throw std::runtime_error("ply: bad format");
 
-    // std::cout << "vertex count " << vcount << std::endl;
-    // std::cout << "face count " << fcount << std::endl;
+    build(faces, begin, mid, depth + 1);
+    int second = build(faces, mid, end, depth + 1);
+    nodes[index].offset = second;
+    nodes[index].count = 0;
+    nodes[index].axis = axis;
+    return index;
+}
+
+
+/// Directory of the mesh cache, empty if it is off.
+static std::string mesh_cache_dir;
+
+void set_mesh_cache_dir (const std::string& dir)
+{
+    mesh_cache_dir = dir;
+}
 
-    for (int i = 0; i < vcount; i++) {
-        float x, y, z;
-        ifs >> x >> y >> z;
-        ifs.getline(buf, 256);
-        M->vertices.push_back(vec3(x,y,z));
+/// Mesh cache file: a MeshCacheHeader, followed by the arrays of the mesh
+/// at the offsets it gives, each aligned to 64 bytes. Loading one is a
+/// mapping of the file and a copy of each array, with no parsing and no
+/// BVH build. A file is only used if its key matches that of the source.
+struct MeshCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    int32_t width;
+    uint64_t key;
+    float bbox[6];
+    /// vertices, normals, vertex_indices, nodes, nodes4, nodes8
+    uint64_t offset[6];
+    uint64_t count[6];
+};
+
+static const char mesh_cache_magic[8] = { 'G','R','A','Y','M','S','H','\n' };
+/// Bump when the file layout or the way meshes are built changes.
+static const uint32_t mesh_cache_version = 3;
+
+/// Hash of the bytes, in four independent lanes so that it runs at
+/// memory speed. Every step of a lane is a bijection of its state, so a
+/// change to any single word always changes the hash.
+static uint64_t hash_bytes (const char* p, size_t n, uint64_t seed)
+{
+    uint64_t h[4] = { seed, seed ^ 1, seed ^ 2, seed ^ 3 };
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            uint64_t w;
+            memcpy(&w, p + i + 8*k, 8);
+            h[k] = (h[k] ^ w) * 0x9e3779b97f4a7c15ULL;
+            h[k] ^= h[k] >> 29;
+        }
     }
-    for (int i = 0; i < fcount; i++) {
-        int cnt, a, b, c;
-        ifs >> cnt >> a >> b >> c;
-        M->vertex_indices.push_back(a);
-        M->vertex_indices.push_back(b);
-        M->vertex_indices.push_back(c);
+    uint64_t r = mix_bits(seed ^ n);
+    for (; i < n; i++) r = mix_bits(r ^ (uint8_t)p[i]);
+    for (int k = 0; k < 4; k++) r = mix_bits(r ^ h[k]);
+    return r;
+}
+
+/// Key of the mesh that load_ply makes of #filename with these settings:
+/// a hash of the file's contents, the settings and the layout of the
+/// cached types.
+static uint64_t mesh_cache_key (const std::string& filename, double floor, double height, int width)
+{
+    uint64_t key = mesh_cache_version;
+    uint64_t layout[4] = { sizeof(vec3), sizeof(LinearBVHNode),
+                           sizeof(WideBVHNode<4>), sizeof(WideBVHNode<8>) };
+    key = hash_bytes((const char*)layout, sizeof(layout), key);
+    double settings[3] = { floor, height, (double)width };
+    key = hash_bytes((const char*)settings, sizeof(settings), key);
+    MappedFile file(filename);
+    return hash_bytes(file.data(), file.size(), key);
+}
+
+static std::string mesh_cache_path (uint64_t key)
+{
+    char name[64];
+    sprintf(name, "/mesh-%016llx.cache", (unsigned long long)key);
+    return mesh_cache_dir + name;
+}
+
+template <typename T>
+static void set_cached_array (MeshCacheHeader& h, int i, const std::vector<T>& v, uint64_t* end)
+{
+    h.offset[i] = (*end + 63) & ~(uint64_t)63;
+    h.count[i] = v.size();
+    *end = h.offset[i] + v.size() * sizeof(T);
+}
+
+template <typename T>
+static void write_cached_array (FILE* fp, const MeshCacheHeader& h, int i,
+                                const std::vector<T>& v, bool* ok)
+{
+    if (!*ok) return;
+    *ok = fseek(fp, h.offset[i], SEEK_SET) == 0 &&
+          (v.empty() || fwrite(&v[0], sizeof(T), v.size(), fp) == v.size());
+}
+
+/// Writes the cache file of a freshly built mesh. The cache only saves
+/// time, so failures are reported and otherwise ignored.
+static void save_mesh_cache (const BVHMesh& M, uint64_t key)
+{
+    MeshCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, mesh_cache_magic, sizeof(h.magic));
+    h.version = mesh_cache_version;
+    h.width = M.width;
+    h.key = key;
+    for (int k = 0; k < 3; k++) {
+        h.bbox[k] = M.bbox.min[k];
+        h.bbox[k+3] = M.bbox.max[k];
+    }
+    uint64_t end = sizeof(h);
+    set_cached_array(h, 0, M.vertices, &end);
+    set_cached_array(h, 1, M.normals, &end);
+    set_cached_array(h, 2, M.vertex_indices, &end);
+    set_cached_array(h, 3, M.nodes, &end);
+    set_cached_array(h, 4, M.nodes4, &end);
+    set_cached_array(h, 5, M.nodes8, &end);
+
+    // Written under another name and renamed, so that a reader never
+    // sees half a file.
+    std::string path = mesh_cache_path(key);
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    bool ok = fp != nullptr;
+    if (ok) {
+        ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+        write_cached_array(fp, h, 0, M.vertices, &ok);
+        write_cached_array(fp, h, 1, M.normals, &ok);
+        write_cached_array(fp, h, 2, M.vertex_indices, &ok);
+        write_cached_array(fp, h, 3, M.nodes, &ok);
+        write_cached_array(fp, h, 4, M.nodes4, &ok);
+        write_cached_array(fp, h, 5, M.nodes8, &ok);
+        ok = (fclose(fp) == 0) && ok;
+    }
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        std::cout << "mesh cache: cannot write " << path << std::endl;
     }
+}
+
+template <typename T>
+static bool read_cached_array (const MappedFile& file, const MeshCacheHeader& h, int i,
+                               std::vector<T>* v)
+{
+    // Empty arrays may have an offset past the end of the file.
+    if (h.count[i] == 0) {
+        v->clear();
+        return true;
+    }
+    if (h.offset[i] > file.size() || h.count[i] > (file.size() - h.offset[i]) / sizeof(T)) {
+        return false;
+    }
+    const T* p = reinterpret_cast<const T*>(file.data() + h.offset[i]);
+    v->assign(p, p + h.count[i]);
+    return true;
+}
+
+/// Checks that every child and face a node refers to is within the
+/// arrays, that children follow their parents, so that there are no
+/// cycles, and that the tree fits the traversal stacks.
+static bool valid_cached_nodes (const std::vector<LinearBVHNode>& nodes, size_t fcount)
+{
+    std::vector<int> depth(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const LinearBVHNode& node = nodes[i];
+        if (node.count > 0) {
+            if (node.offset < 0 || (size_t)node.offset + node.count > fcount) return false;
+            continue;
+        }
+        if (node.axis > 2 || depth[i] >= max_bvh_depth || i + 1 >= nodes.size() ||
+            node.offset <= (int64_t)i + 1 || (size_t)node.offset >= nodes.size()) {
+            return false;
+        }
+        depth[i + 1] = depth[node.offset] = depth[i] + 1;
+    }
+    return true;
+}
+
+template<int N>
+static bool valid_cached_nodes (const std::vector<WideBVHNode<N>>& wnodes, size_t fcount)
+{
+    std::vector<int> depth(wnodes.size(), 0);
+    for (size_t i = 0; i < wnodes.size(); i++) {
+        const WideBVHNode<N>& node = wnodes[i];
+        if (node.nchildren < 1 || node.nchildren > N) return false;
+        for (int k = 0; k < node.nchildren; k++) {
+            int32_t offset = node.offset[k];
+            if (node.count[k] > 0) {
+                if (offset < 0 || (size_t)offset + node.count[k] > fcount) return false;
+                continue;
+            }
+            if (depth[i] >= max_bvh_depth || offset <= (int64_t)i ||
+                (size_t)offset >= wnodes.size()) {
+                return false;
+            }
+            depth[offset] = depth[i] + 1;
+        }
+    }
+    return true;
+}
+
+/// The checks of read_ply and more, so that a corrupt file whose key
+/// happens to match can't make the traversals read out of bounds.
+static bool valid_cached_mesh (const BVHMesh& M)
+{
+    if (M.vertex_indices.size() % 3 != 0 || M.normals.size() != M.vertices.size()) {
+        return false;
+    }
+    for (int i : M.vertex_indices) {
+        if (i < 0 || (size_t)i >= M.vertices.size()) return false;
+    }
+    size_t fcount = M.vertex_indices.size() / 3;
+    switch (M.width) {
+        case 2: return (fcount == 0 || !M.nodes.empty()) && valid_cached_nodes(M.nodes, fcount);
+        case 4: return (fcount == 0 || !M.nodes4.empty()) && valid_cached_nodes(M.nodes4, fcount);
+        case 8: return (fcount == 0 || !M.nodes8.empty()) && valid_cached_nodes(M.nodes8, fcount);
+        default: return false;
+    }
+}
+
+/// @return the cached mesh, or nullptr if there is none or it is stale
+/// or corrupt
+static BVHMesh* load_mesh_cache (uint64_t key)
+{
+    std::string path = mesh_cache_path(key);
+    if (access(path.c_str(), R_OK) != 0) return nullptr;
+    MappedFile file(path);
+    MeshCacheHeader h;
+    if (file.size() < sizeof(h)) return nullptr;
+    memcpy(&h, file.data(), sizeof(h));
+    if (memcmp(h.magic, mesh_cache_magic, sizeof(h.magic)) != 0 ||
+        h.version != mesh_cache_version || h.key != key) {
+        return nullptr;
+    }
+
+    std::unique_ptr<BVHMesh> M(new BVHMesh());
+    M->width = h.width;
+    M->smooth = true;
+    M->bbox = BBox(vec3(h.bbox[0], h.bbox[1], h.bbox[2]), vec3(h.bbox[3], h.bbox[4], h.bbox[5]));
+    bool ok = read_cached_array(file, h, 0, &M->vertices) &&
+              read_cached_array(file, h, 1, &M->normals) &&
+              read_cached_array(file, h, 2, &M->vertex_indices) &&
+              read_cached_array(file, h, 3, &M->nodes) &&
+              read_cached_array(file, h, 4, &M->nodes4) &&
+              read_cached_array(file, h, 5, &M->nodes8);
+    if (!ok || !valid_cached_mesh(*M)) {
+        std::cout << "mesh cache: ignoring corrupt " << path << std::endl;
+        return nullptr;
+    }
+    M->calculate_areas();
+    return M.release();
+}
+
+BVHMesh* load_ply (const std::string& filename, double floor=NAN, double height=NAN,
+                   int bvh_width=default_bvh_width)
+{
+    uint64_t cache_key = 0;
+    if (!mesh_cache_dir.empty()) {
+        Timer timer;
+        cache_key = mesh_cache_key(filename, floor, height, bvh_width);
+        BVHMesh* M = load_mesh_cache(cache_key);
+        timer.stop();
+        if (M) {
+            std::cout << "ply " << filename << ": " << M->vertices.size() << " vertices, "
+                      << M->vertex_indices.size() / 3 << " triangles, "
+                      << M->node_count() << " BVH" << M->width << " nodes, from cache in "
+                      << timer << std::endl;
+            return M;
+        }
+    }
+
+    Timer timer;
+    PlyMesh ply;
+    read_ply(filename, &ply);
+    timer.stop();
+
+    auto* M = new BVHMesh();
+    M->width = bvh_width;
+    M->vertices.swap(ply.vertices);
+    M->vertex_indices.swap(ply.indices);
 
     M->calculate_bbox();
     if (!std::isnan(height)) M->adjust_height(height);
     if (!std::isnan(floor)) M->adjust_floor(floor);
     M->smooth = true;
-    M->calculate_smooth_normals();
-
-    M->root = BVHNode(M);
-    for (int i = 0; i < fcount; i++) M->root.add(i);
-    M->root.split();
-    // std::cout << "FFF real count "<<fcount<<" counted "<<M->root.calc()<<"\n";
-    // std::vector<int> counts(fcount, 0);
-    // M->root.plot(counts);
-    // for(int x : counts) {
-    //     std::cout << "CCC " << x << "\n";
-    // }
+    if (!ply.normals.empty()) {
+        // The scaling of adjust_height is uniform, so the normals of the
+        // file still hold.
+        M->normals.swap(ply.normals);
+        for (auto& n : M->normals) {
+            n = (n != vec3(0)) ? normalize(n) : vec3(0,1,0);
+        }
+    }
+    else {
+        M->calculate_smooth_normals();
+    }
+
+    Timer build_timer;
+    M->build();
+    build_timer.stop();
+    M->calculate_areas();
+    std::cout << "ply " << filename << ": " << M->vertices.size() << " vertices, "
+              << M->vertex_indices.size() / 3 << " triangles, read in " << timer << ", "
+              << M->node_count() << " BVH" << M->width << " nodes, built in "
+              << build_timer << std::endl;
+    if (!mesh_cache_dir.empty()) save_mesh_cache(*M, cache_key);
     return M;
 }
 
@@ -654,13 +1709,18 @@ void evaluate_shape (Value& val, List& args)
             m->vertex_indices.push_back( i++ );
             m->vertex_indices.push_back( i++ );
         }
+        m->calculate_bbox();
+        m->calculate_areas();
         S = m;
     }
     else if (name == "ply_mesh") {
         double height = *pop_attr<double>("height", make_shared<double>(NAN), args);
         double floor = *pop_attr<double>("floor", make_shared<double>(NAN), args);
-        std::ifstream ifs(*pop<std::string>(args));
-        auto* m = load_ply(ifs, floor, height);
+        int width = *pop_attr<double>("bvh_width", make_shared<double>(default_bvh_width), args);
+        if (width != 2 && width != 4 && width != 8) {
+            throw std::runtime_error("ply_mesh: bvh_width must be 2, 4 or 8");
+        }
+        auto* m = load_ply(*pop<std::string>(args), floor, height, width);
         S = m;
     }
     else {
@@ -1,5 +1,7 @@
 #include "gray.hpp"
 #include "lisc.hpp"
+#include "distribution.hpp"
+#include "film.hpp"
 extern "C" {
 #include "rgbe.h"
 }
@@ -59,6 +61,7 @@ public:
     DebevecSkylight (const std::string& filename)
     {
         load_hdr(filename);
+        build_distribution();
     }
 
     Spectrum sample (const vec3& dir) const
@@ -77,6 +80,45 @@ public:
         return R[uu + vv*resx];
     }
 
+    Spectrum sample_direction (const vec2& uv, vec3* wi, float* pdf) const
+    {
+        // Pick a point of the probe image, mapped to [0,1)^2, and turn it
+        // into the direction it is the image of. The image is of the whole
+        // sphere of directions: the distance of (u,v) from the center is
+        // theta/pi, so the direction is
+        // (u/rho sin(theta), -v/rho sin(theta), cos(theta)).
+        float map_pdf;
+        vec2 st = distribution->sample(uv, &map_pdf);
+        float u = 2 * st.x - 1;
+        float v = 2 * st.y - 1;
+        float rho = sqrtf(u*u + v*v);
+        if (map_pdf == 0 || rho >= 1 || rho == 0) {
+            *pdf = 0;
+            return Spectrum(0.0f);
+        }
+        float theta = M_PI * rho;
+        float sin_theta = sinf(theta);
+        *wi = vec3(u / rho * sin_theta, -v / rho * sin_theta, cosf(theta));
+        *pdf = map_pdf * jacobian(theta, sin_theta);
+        return sample(*wi);
+    }
+
+    float pdf (const vec3& wi) const
+    {
+        float theta = acosf(std::max(-1.0f, std::min(1.0f, wi.z)));
+        float sin_theta = sqrtf(wi.x*wi.x + wi.y*wi.y);
+        if (sin_theta == 0) return 0;
+        float rho = theta / M_PI;
+        float u = wi.x / sin_theta * rho;
+        float v = -wi.y / sin_theta * rho;
+        return distribution->pdf(vec2((u + 1) / 2, (v + 1) / 2)) * jacobian(theta, sin_theta);
+    }
+
+    bool can_sample () const
+    {
+        return true;
+    }
+
     void load_hdr (const std::string& filename)
     {
         FILE* fp = fopen(filename.c_str(), "rb");
@@ -93,6 +135,41 @@ public:
             throw std::runtime_error("Error reading HDR file pixels.");
         }
     }
+
+private:
+    /// Distribution over the probe image mapped to [0,1)^2.
+    std::unique_ptr<Distribution2D> distribution;
+
+    /// Converts a density over the [0,1)^2 mapped probe image into a
+    /// density over solid angle. A patch of the image covers
+    /// d(omega) = sin(theta) d(theta) d(phi) and has area
+    /// dA = rho d(rho) d(phi) = theta/pi^2 d(theta) d(phi) in the [-1,1]^2
+    /// image, which is 4 times the area in [0,1)^2.
+    static float jacobian (float theta, float sin_theta)
+    {
+        return theta / (4 * M_PI * M_PI * sin_theta);
+    }
+
+    /// Makes the texels as likely to be picked as their share of the
+    /// power coming from the sky: luminance times the solid angle the
+    /// texel covers. The corners outside the circle get nothing.
+    void build_distribution ()
+    {
+        std::vector<float> f(resx*resy);
+        for (int y = 0; y < resy; y++) {
+            for (int x = 0; x < resx; x++) {
+                float u = 2 * (x + 0.5f) / resx - 1;
+                float v = 2 * (y + 0.5f) / resy - 1;
+                float rho = sqrtf(u*u + v*v);
+                if (rho >= 1) continue;
+                float theta = M_PI * rho;
+                // sin(theta) / theta, which goes to 1 at the center.
+                float area = (rho > 0) ? sinf(theta) / theta : 1;
+                f[x + y*resx] = Pixel::luminance(R[x + y*resx]) * area;
+            }
+        }
+        distribution.reset(new Distribution2D(&f[0], resx, resy));
+    }
 };
 
 
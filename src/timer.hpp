@@ -37,6 +37,7 @@ private:
     std::chrono::duration<double> d;
 };
 
+inline
 std::ostream& operator<< (std::ostream& os, const Timer& tt)
 {
     float t = tt.d.count();
@@ -0,0 +1,232 @@
+#include "tonemap.hpp"
+#include "film.hpp"
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The kernels read the radiance and the weight of a pixel as four
+// consecutive floats.
+static_assert(sizeof(Spectrum) == 3*sizeof(float), "Spectrum should be three packed floats");
+static_assert(sizeof(Pixel) == 6*sizeof(float), "Pixel should be L, weight, Y2 and count");
+
+/// Keeps the logarithm of black pixels finite.
+static const float log_delta = 1e-5f;
+
+// Approximations of log2 and exp2 that are accurate to about 1e-7 and
+// 2e-7 relative, far below what 8-bit output can show. The SSE versions
+// below compute the same polynomials four at a time.
+
+static inline
+float fast_log2 (float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, 4);
+    float e = (int)(bits >> 23) - 127;
+    bits = (bits & 0x7fffff) | 0x3f800000;
+    float m;
+    memcpy(&m, &bits, 4);
+    // m in [sqrt(1/2), sqrt(2)), where the series of atanh converges fast.
+    if (m > 1.41421356f) {
+        m *= 0.5f;
+        e += 1;
+    }
+    float t = (m - 1) / (m + 1);
+    float t2 = t * t;
+    return e + t * (2.88539008f + t2 * (0.96179669f + t2 * (0.57707802f + t2 * 0.41219858f)));
+}
+
+static inline
+float fast_exp2 (float x)
+{
+    x = std::max(-126.0f, std::min(126.0f, x));
+    float i = floorf(x + 0.5f);
+    float f = x - i;
+    float p = 1 + f * (0.69314718f + f * (0.24022651f + f * (0.05550411f +
+                  f * (0.00961813f + f * (0.00133336f + f * 0.00015404f)))));
+    uint32_t bits = (uint32_t)((int)i + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, 4);
+    return p * scale;
+}
+
+#if defined(__SSE2__)
+static inline
+__m128 fast_log2 (__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128i bits = _mm_castps_si128(x);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)),
+                                             _mm_set1_epi32(0x3f800000)));
+    __m128 big = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+    m = _mm_mul_ps(m, _mm_or_ps(_mm_and_ps(big, _mm_set1_ps(0.5f)), _mm_andnot_ps(big, one)));
+    e = _mm_add_ps(e, _mm_and_ps(big, one));
+    __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+    __m128 t2 = _mm_mul_ps(t, t);
+    __m128 p = _mm_set1_ps(0.41219858f);
+    p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(0.57707802f));
+    p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(0.96179669f));
+    p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(2.88539008f));
+    return _mm_add_ps(e, _mm_mul_ps(t, p));
+}
+
+static inline
+__m128 fast_exp2 (__m128 x)
+{
+    x = _mm_max_ps(_mm_set1_ps(-126.0f), _mm_min_ps(_mm_set1_ps(126.0f), x));
+    __m128i i = _mm_cvtps_epi32(x);
+    __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(i));
+    __m128 p = _mm_set1_ps(0.00015404f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.00133336f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.00961813f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.05550411f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.24022651f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.69314718f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+    __m128i scale = _mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(scale));
+}
+
+/// Loads the normalized radiance of four pixels as vectors of r, g and b.
+static inline
+void load4 (const Pixel* p, __m128* r, __m128* g, __m128* b)
+{
+    __m128 r0 = _mm_loadu_ps(&p[0].L[0]);
+    __m128 r1 = _mm_loadu_ps(&p[1].L[0]);
+    __m128 r2 = _mm_loadu_ps(&p[2].L[0]);
+    __m128 r3 = _mm_loadu_ps(&p[3].L[0]);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    // r3 now holds the weights. Pixels without samples are black.
+    __m128 inv_w = _mm_and_ps(_mm_cmpgt_ps(r3, _mm_setzero_ps()),
+                              _mm_div_ps(_mm_set1_ps(1.0f), r3));
+    *r = _mm_mul_ps(r0, inv_w);
+    *g = _mm_mul_ps(r1, inv_w);
+    *b = _mm_mul_ps(r2, inv_w);
+}
+
+static inline
+__m128 luminance4 (__m128 r, __m128 g, __m128 b)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.27f)),
+                                 _mm_mul_ps(g, _mm_set1_ps(0.67f))),
+                      _mm_mul_ps(b, _mm_set1_ps(0.06f)));
+}
+#endif
+
+/// Runs f(y0, y1, band) on #threads bands of consecutive rows.
+template <typename F>
+static void parallel_bands (int rows, int threads, F f)
+{
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) {
+        pool.emplace_back(f, rows * t / threads, rows * (t+1) / threads, t);
+    }
+    f(0, rows / threads, 0);
+    for (auto& th : pool) th.join();
+}
+
+void tone_map (const Film& film, const ToneMap& tm, int threads, std::vector<uint8_t>* rgb)
+{
+    int xres = film.xres;
+    int yres = film.yres;
+    const Pixel* pixels = film.pixels();
+    threads = std::max(1, std::min(threads, yres));
+    rgb->resize((size_t)xres * yres * 3);
+
+    // Sum of the log luminances and the largest luminance.
+    std::vector<double> log_sum(threads, 0.0);
+    std::vector<float> max_Y(threads, 0.0f);
+    parallel_bands(yres, threads, [&](int y0, int y1, int band) {
+        float band_max = 0;
+        for (int y = y0; y < y1; y++) {
+            const Pixel* row = &pixels[y * xres];
+            float row_sum = 0;
+            int x = 0;
+#if defined(__SSE2__)
+            __m128 sum4 = _mm_setzero_ps();
+            __m128 max4 = _mm_setzero_ps();
+            for (; x + 4 <= xres; x += 4) {
+                __m128 r, g, b;
+                load4(row + x, &r, &g, &b);
+                __m128 Y = luminance4(r, g, b);
+                sum4 = _mm_add_ps(sum4, fast_log2(_mm_add_ps(Y, _mm_set1_ps(log_delta))));
+                max4 = _mm_max_ps(max4, Y);
+            }
+            float s[4], m[4];
+            _mm_storeu_ps(s, sum4);
+            _mm_storeu_ps(m, max4);
+            row_sum = (s[0] + s[1]) + (s[2] + s[3]);
+            band_max = std::max(band_max, std::max(std::max(m[0], m[1]), std::max(m[2], m[3])));
+#endif
+            for (; x < xres; x++) {
+                float Y = row[x].luminosity();
+                row_sum += fast_log2(Y + log_delta);
+                band_max = std::max(band_max, Y);
+            }
+            log_sum[band] += row_sum;
+        }
+        max_Y[band] = band_max;
+    });
+
+    double total = 0;
+    float Y_max = 0;
+    for (int t = 0; t < threads; t++) {
+        total += log_sum[t];
+        Y_max = std::max(Y_max, max_Y[t]);
+    }
+    float Y_avg = fast_exp2(total / std::max(1, xres * yres));
+    // Luminance Y is mapped to Ls = scale*Y, and then to Ld, the curve of
+    // Reinhard's equation 4 with the brightest pixel at white.
+    float scale = tm.key * fast_exp2(tm.exposure) / Y_avg;
+    float white = std::max(scale * Y_max, 1e-6f);
+    float inv_white2 = 1 / (white * white);
+    float inv_gamma = 1 / tm.gamma;
+
+    parallel_bands(yres, threads, [&](int y0, int y1, int band) {
+        for (int y = y0; y < y1; y++) {
+            const Pixel* row = &pixels[y * xres];
+            // The film's first row is the bottom one.
+            uint8_t* out = &(*rgb)[(size_t)(yres-1-y) * xres * 3];
+            int x = 0;
+#if defined(__SSE2__)
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 tiny = _mm_set1_ps(1e-30f);
+            for (; x + 4 <= xres; x += 4) {
+                __m128 c[3];
+                load4(row + x, &c[0], &c[1], &c[2]);
+                __m128 Ls = _mm_mul_ps(luminance4(c[0], c[1], c[2]), _mm_set1_ps(scale));
+                // Ld / Y, which scales all three channels.
+                __m128 ratio = _mm_div_ps(
+                    _mm_mul_ps(_mm_set1_ps(scale),
+                               _mm_add_ps(one, _mm_mul_ps(Ls, _mm_set1_ps(inv_white2)))),
+                    _mm_add_ps(one, Ls));
+                int32_t v[3][4];
+                for (int k = 0; k < 3; k++) {
+                    __m128 ck = _mm_min_ps(one, _mm_max_ps(tiny, _mm_mul_ps(c[k], ratio)));
+                    ck = fast_exp2(_mm_mul_ps(fast_log2(ck), _mm_set1_ps(inv_gamma)));
+                    ck = _mm_add_ps(_mm_mul_ps(ck, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f));
+                    _mm_storeu_si128((__m128i*)v[k], _mm_cvttps_epi32(ck));
+                }
+                for (int i = 0; i < 4; i++) {
+                    out[(x+i)*3+0] = v[0][i];
+                    out[(x+i)*3+1] = v[1][i];
+                    out[(x+i)*3+2] = v[2][i];
+                }
+            }
+#endif
+            for (; x < xres; x++) {
+                Spectrum c = row[x].normalized();
+                float Ls = scale * Pixel::luminance(c);
+                float ratio = scale * (1 + Ls * inv_white2) / (1 + Ls);
+                for (int k = 0; k < 3; k++) {
+                    float ck = std::min(1.0f, std::max(1e-30f, c[k] * ratio));
+                    ck = fast_exp2(fast_log2(ck) * inv_gamma);
+                    out[x*3+k] = (int)(ck * 255.0f + 0.5f);
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,29 @@
+#ifndef _TONEMAP_HPP_
+#define _TONEMAP_HPP_
+
+#include <cstdint>
+#include <vector>
+
+class Film;
+
+/// Settings of the tone mapping of the 8-bit outputs.
+struct ToneMap
+{
+    /// In stops, on top of the exposure that the key gives.
+    float exposure;
+    float gamma;
+    /// Brightness that the log-average luminance of the image is mapped
+    /// to, before the curve.
+    float key;
+
+    ToneMap () : exposure(0), gamma(2.2f), key(0.18f) { }
+};
+
+/// Reinhard's photographic tone reproduction ('02) on the luminance of
+/// the film, with the brightest pixel mapped to white. The log-average
+/// reduction and the mapping each run in one pass over the film, split
+/// over #threads threads, with SSE kernels where available.
+/// @par rgb    [out] 8-bit RGB of the film, top row first
+void tone_map (const Film& film, const ToneMap& tm, int threads, std::vector<uint8_t>* rgb);
+
+#endif // _TONEMAP_HPP_
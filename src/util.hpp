@@ -120,6 +120,49 @@ float uniform_hemisphere_pdf ()
     return 1.0f / M_2PI;
 }
 
+/** Direction on the z>0 hemisphere with density proportional to the
+ * cosine of its angle with the z axis: a uniform point on the unit disk,
+ * projected up onto the hemisphere.
+ */
+inline
+vec3 cosine_sample_hemisphere (const vec2& uv)
+{
+    float r = sqrtf(uv[0]);
+    float phi = uv[1] * M_2PI;
+    float z = sqrtf(std::max(0.0f, 1.0f - uv[0]));
+
+    return vec3(cos(phi)*r, sin(phi)*r, z);
+}
+
+inline
+float cosine_hemisphere_pdf (float cos_theta)
+{
+    return cos_theta / M_PI;
+}
+
+/** Multiple importance sampling weight of a sample taken with density
+ * pdf_f when the other strategy would have had density pdf_g.
+ */
+inline
+float power_heuristic (float pdf_f, float pdf_g)
+{
+    float f2 = pdf_f * pdf_f;
+    float g2 = pdf_g * pdf_g;
+    return (f2 + g2 > 0) ? f2 / (f2 + g2) : 0;
+}
+
+/** Converts a density per area at point p with normal n into a density
+ * per solid angle as seen from ref.
+ */
+inline
+float area_to_solid_angle (float pdf, const vec3& ref, const vec3& p, const vec3& n)
+{
+    vec3 d = p - ref;
+    float dist2 = dot(d, d);
+    float cos_light = fabs(dot(n, d)) / sqrtf(dist2);
+    return (cos_light > 0) ? pdf * dist2 / cos_light : 0;
+}
+
 
 /** Compute cosine of angle between w and normal (0,0,1).
  * w must be unit vector.
@@ -0,0 +1,246 @@
+#include "renderjob.hpp"
+#include "gray.hpp"
+#include "util.hpp"
+#include <algorithm>
+
+namespace threaded_render {
+
+/// State of the paths of one wave, stored as a structure of arrays.
+/// Paths are addressed by index; the stages pass around lists of the
+/// indices that are still alive.
+struct PathQueue
+{
+    std::vector<vec3> origin;
+    std::vector<vec3> direction;
+    /// Path throughput.
+    std::vector<Spectrum> beta;
+    std::vector<Spectrum> L;
+    /// Sample position on the tile film.
+    std::vector<vec2> film_pos;
+    /// Index of the pixel within the wave, and of the sample of that pixel.
+    std::vector<int> pixel;
+    std::vector<int> sample;
+    std::vector<Isect> isect;
+    std::vector<Isect> prev;
+    std::vector<char> has_prev;
+    std::vector<char> hit;
+    /// Density of the BSDF sample that gave the ray, or zero if the lights
+    /// could not have been sampled from its origin.
+    std::vector<float> bsdf_pdf;
+    /// Shadow ray of the light sample taken at the last vertex, and what it
+    /// adds to L if nothing blocks it.
+    std::vector<Ray> shadow;
+    std::vector<Spectrum> shadow_L;
+
+    void resize (int n)
+    {
+        origin.resize(n);
+        direction.resize(n);
+        beta.resize(n);
+        L.resize(n);
+        film_pos.resize(n);
+        pixel.resize(n);
+        sample.resize(n);
+        isect.resize(n);
+        prev.resize(n);
+        has_prev.resize(n);
+        hit.resize(n);
+        bsdf_pdf.resize(n);
+        shadow.resize(n);
+        shadow_L.resize(n);
+    }
+};
+
+/// Finds the closest hit of every active path.
+static void stage_intersect (const Scene& scene, PathQueue& q, const std::vector<int>& active)
+{
+    for (int i : active) {
+        Ray ray(q.origin[i], q.direction[i]);
+        q.hit[i] = scene.intersect(ray, &q.isect[i], q.has_prev[i] ? &q.prev[i] : nullptr);
+    }
+}
+
+/// Adds the sky to the escaped paths and the emission to the others,
+/// weighted against light sampling as in PathIntegrator.
+/// Paths that may bounce further are copied to #next.
+static void stage_emit (const Scene& scene, PathQueue& q, int depth, int max_depth,
+                        const std::vector<int>& active, std::vector<int>& next)
+{
+    int light_count = scene.light_count();
+    next.clear();
+    for (int i : active) {
+        float bsdf_pdf = q.bsdf_pdf[i];
+        if (!q.hit[i]) {
+            float w = 1;
+            if (bsdf_pdf > 0) {
+                w = power_heuristic(bsdf_pdf, scene.skylight->pdf(q.direction[i]) / light_count);
+            }
+            q.L[i] += q.beta[i] * scene.skylight->sample(q.direction[i]) * w;
+            continue;
+        }
+        const Isect& isect = q.isect[i];
+        if (isect.Le != Spectrum(0,0,0)) {
+            auto* light = static_cast<const GeometricPrimitive*>(isect.prim);
+            float w = 1;
+            if (bsdf_pdf > 0 && light->is_light()) {
+                float light_pdf = area_to_solid_angle(light->area_pdf(isect.ng),
+                                                      q.origin[i], isect.p, isect.ng);
+                w = power_heuristic(bsdf_pdf, light_pdf / light_count);
+            }
+            q.L[i] += q.beta[i] * isect.Le * w;
+        }
+        if (depth < max_depth) next.push_back(i);
+    }
+}
+
+/// Samples the BSDFs and sets up the next ray of each surviving path.
+/// Paths at non-specular surfaces also sample a light; those that need a
+/// shadow ray for it are listed in #shadowed.
+/// The paths must be sorted by material.
+static void stage_shade (const Scene& scene, std::vector<std::unique_ptr<SampleGenerator>>& samplers,
+                         MemoryArena& arena, PathQueue& q, int depth, int rr_depth,
+                         const std::vector<int>& active, std::vector<int>& next,
+                         std::vector<int>& shadowed)
+{
+    int light_count = scene.light_count();
+    next.clear();
+    shadowed.clear();
+    for (int i : active) {
+        Sample& sample = samplers[q.pixel[i]]->get(q.sample[i]);
+        const Isect& isect = q.isect[i];
+
+        const BSDF* bsdf = isect.mat->get_bsdf(isect.p, sample.rand2f(), arena);
+        Transform tangent_from_world = build_tangent_from_world(isect.n);
+        vec3 wo_t = tangent_from_world.vector(-q.direction[i]);
+        vec3 wi_t;
+        float pdf;
+        Spectrum f = bsdf->sample(wo_t, &wi_t, sample.get2d(), &pdf);
+        vec2 light_sample = sample.get2d();
+
+        Spectrum& beta = q.beta[i];
+        if (!bsdf->is_specular() && light_count > 0) {
+            Spectrum Le;
+            float light_pdf = scene.sample_light(isect.p, light_sample, &q.shadow[i], &Le);
+            vec3 light_wi_t = tangent_from_world.vector(q.shadow[i].d);
+            Spectrum light_f = (light_pdf > 0) ? bsdf->f(wo_t, light_wi_t) : Spectrum(0.0f);
+            if (light_f != Spectrum(0,0,0)) {
+                float w = power_heuristic(light_pdf, bsdf->pdf(wo_t, light_wi_t));
+                q.shadow_L[i] = beta * (light_f * Le * abs_cos_theta(light_wi_t) * (w / light_pdf));
+                shadowed.push_back(i);
+            }
+        }
+        // The shadow ray starts from this vertex.
+        q.prev[i] = isect;
+        q.has_prev[i] = 1;
+        if (f == Spectrum(0,0,0) || pdf == 0) continue;
+
+        q.bsdf_pdf[i] = bsdf->is_specular() ? 0 : pdf;
+        beta *= f * abs_cos_theta(wi_t) / pdf;
+
+        if (depth + 1 >= rr_depth) {
+            float p = std::min(1.0f, std::max(beta.x, std::max(beta.y, beta.z)));
+            if (sample.randf() >= p) continue;
+            beta /= p;
+        }
+
+        q.origin[i] = isect.p;
+        q.direction[i] = inverse(tangent_from_world).vector(wi_t);
+        next.push_back(i);
+    }
+    // The BSDFs are not needed past this stage.
+    arena.reset();
+}
+
+/// Traces the shadow rays of the light samples and adds those that reach
+/// their light.
+static void stage_occlude (const Scene& scene, PathQueue& q, const std::vector<int>& shadowed)
+{
+    for (int i : shadowed) {
+        if (!scene.occluded(q.shadow[i], &q.prev[i])) q.L[i] += q.shadow_L[i];
+    }
+}
+
+/// Renders the tile in waves of pixels. All the samples of the pixels of a
+/// wave are advanced together through the stages generate, intersect,
+/// emit, shade and extend, and the hits are sorted by material before
+/// shading so that the same get_bsdf and BSDF::sample code runs back to
+/// back. Shadow rays for the light samples are traced in a stage of their
+/// own after shading. This is the estimator of PathIntegrator, with the
+/// same light sampling and weights, so the two agree in expectation.
+void Task::render_wavefront (MemoryArena& arena)
+{
+    // Roughly this many paths per wave.
+    const int wave_paths = 8192;
+    int group = std::max(1, std::min(xres*yres, wave_paths / spp));
+
+    std::vector<std::unique_ptr<SampleGenerator>> samplers(group);
+    for (auto& s : samplers) {
+        s.reset(make_sampler(sampler_name, spp));
+    }
+    std::vector<Pcg32> generators(group);
+
+    PathQueue q;
+    std::vector<int> active;
+    std::vector<int> next;
+    std::vector<int> shadowed;
+    const Scene& scene = job->scene;
+    Camera* cam = scene.camera.get();
+
+    for (int first = 0; first < xres*yres; first += group) {
+        int npix = std::min(group, xres*yres - first);
+        int npaths = npix * spp;
+        q.resize(npaths);
+        active.resize(npaths);
+
+        // Generate the camera rays.
+        for (int p = 0; p < npix; p++) {
+            int lx = (first + p) % xres;
+            int ly = (first + p) / xres;
+            int gx = xofs + lx;
+            int gy = yofs + ly;
+            start_pixel(samplers[p].get(), &generators[p], gx, gy);
+
+            for (int s = 0; s < spp; s++) {
+                int i = p*spp + s;
+                Sample& sample = samplers[p]->get(s);
+                vec2 dxy = sample.get2d();
+                float fgx = (gx+dxy.x) / job->film.xres;
+                float fgy = (gy+dxy.y) / job->film.yres;
+                vec2 lens_sample = sample.get2d();
+                Ray ray(cam->generate_ray(fgx, fgy, lens_sample.x, lens_sample.y));
+
+                q.origin[i] = ray.o;
+                q.direction[i] = ray.d;
+                q.beta[i] = Spectrum(1.0f);
+                q.L[i] = Spectrum(0.0f);
+                q.film_pos[i] = vec2((lx+dxy.x) / xres, (ly+dxy.y) / yres);
+                q.pixel[i] = p;
+                q.sample[i] = s;
+                q.has_prev[i] = 0;
+                q.bsdf_pdf[i] = 0;
+                active[i] = i;
+            }
+        }
+
+        for (int depth = 0; !active.empty(); depth++) {
+            stage_intersect(scene, q, active);
+            stage_emit(scene, q, depth, max_depth, active, next);
+            active.swap(next);
+
+            std::sort(active.begin(), active.end(), [&](int a, int b) {
+                const Material* ma = q.isect[a].mat;
+                const Material* mb = q.isect[b].mat;
+                return (ma != mb) ? std::less<const Material*>()(ma, mb) : (a < b);
+            });
+            stage_shade(scene, samplers, arena, q, depth, rr_depth, active, next, shadowed);
+            stage_occlude(scene, q, shadowed);
+            active.swap(next);
+        }
+
+        for (int i = 0; i < npaths; i++) {
+            tile.add_sample(q.film_pos[i].x, q.film_pos[i].y, q.L[i]);
+        }
+    }
+}
+
+} // namespace threaded_render